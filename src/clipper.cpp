@@ -0,0 +1,104 @@
+#include "clipper.hpp"
+
+#include <utility>
+
+// a vertex of the polygon being clipped
+struct ClipVertex {
+	// camera space position
+	V3 q;
+	// barycentric coordinates in the original triangle
+	V3 B;
+};
+
+// the near plane and the four guard band edges
+constexpr int CLIP_PLANES = 5;
+// a convex polygon cut by a plane gains at most one vertex, so a triangle
+// clipped by every plane has at most this many
+constexpr int MAX_CLIP_VERTICES = 3 + CLIP_PLANES;
+
+// signed distance to each clip plane in camera space, positive inside.
+// q = <u * w, v * w, w>, so u >= -GUARD_BAND becomes q.x + GUARD_BAND * q.z >= 0, and so on
+static float PlaneDistance(int plane, const PPCamera &camera, const V3 &q) {
+	switch (plane) {
+		case 0: return q.z() - PPCamera::NEAR_Z;
+		case 1: return q.x() + GUARD_BAND * q.z();
+		case 2: return (camera.w + GUARD_BAND) * q.z() - q.x();
+		case 3: return q.y() + GUARD_BAND * q.z();
+		default: return (camera.h + GUARD_BAND) * q.z() - q.y();
+	}
+}
+
+bool InsideGuardBand(const PPCamera &camera, const V3 &projected) {
+	return projected.z() >= 0.0f &&
+		projected.x() >= -GUARD_BAND && projected.x() <= camera.w + GUARD_BAND &&
+		projected.y() >= -GUARD_BAND && projected.y() <= camera.h + GUARD_BAND;
+}
+
+// Sutherland-Hodgman: keep the part of the polygon on the inside of one plane.
+// out has room for MAX_CLIP_VERTICES. only a sliver whose rounding makes it cross the
+// plane more than twice could need more, and it covers next to nothing, so it is dropped
+static int ClipPolygon(int plane, const PPCamera &camera, const ClipVertex *in, int count, ClipVertex *out) {
+	int outCount = 0;
+
+	for (int i = 0; i < count; i++) {
+		const ClipVertex &a = in[i];
+		const ClipVertex &b = in[(i + 1) % count];
+		const float da = PlaneDistance(plane, camera, a.q);
+		const float db = PlaneDistance(plane, camera, b.q);
+
+		if (da >= 0.0f) {
+			if (outCount == MAX_CLIP_VERTICES) return 0;
+			out[outCount++] = a;
+		}
+
+		// the edge crosses the plane, add the crossing point.
+		// camera space is before the perspective divide, so linear interpolation is exact here.
+		// always from the inside end, so the triangle on the other side of the edge, which
+		// walks it the other way, gets the same point to the bit
+		if ((da >= 0.0f) != (db >= 0.0f)) {
+			if (outCount == MAX_CLIP_VERTICES) return 0;
+
+			const ClipVertex &inside = da >= 0.0f ? a : b, &outside = da >= 0.0f ? b : a;
+			const float dIn = da >= 0.0f ? da : db, dOut = da >= 0.0f ? db : da;
+			const float t = dIn / (dIn - dOut);
+			out[outCount++] = ClipVertex{inside.q + (outside.q - inside.q) * t, inside.B + (outside.B - inside.B) * t};
+		}
+	}
+
+	return outCount;
+}
+
+int ClipTriangle(const PPCamera &camera, uint32_t triangle, const V3 &q0, const V3 &q1, const V3 &q2, std::vector<ClippedTriangle> &out) {
+	ClipVertex buffers[2][MAX_CLIP_VERTICES];
+	ClipVertex *polygon = buffers[0], *scratch = buffers[1];
+
+	polygon[0] = ClipVertex{q0, V3(1, 0, 0)};
+	polygon[1] = ClipVertex{q1, V3(0, 1, 0)};
+	polygon[2] = ClipVertex{q2, V3(0, 0, 1)};
+	int count = 3;
+
+	// near plane first, so the guard band planes only see points in front of the camera
+	for (int plane = 0; plane < CLIP_PLANES && count > 0; plane++) {
+		count = ClipPolygon(plane, camera, polygon, count, scratch);
+		std::swap(polygon, scratch);
+	}
+
+	if (count < 3) return 0;
+
+	// project directly, points on the near plane would fail ProjectPoint's check. the same
+	// divide as PPCamera::ProjectPoints, so vertices kept from the triangle land where they
+	// do in the unclipped triangles around it
+	V3 projected[MAX_CLIP_VERTICES];
+	for (int i = 0; i < count; i++) projected[i] = PPCamera::PerspectiveDivide(polygon[i].q);
+
+	// the polygon is convex, so a fan from the first vertex covers it
+	for (int i = 1; i + 1 < count; i++) {
+		out.push_back(ClippedTriangle{
+			triangle,
+			projected[0], projected[i], projected[i + 1],
+			M3::FromColumns(polygon[0].B, polygon[i].B, polygon[i + 1].B)
+		});
+	}
+
+	return count - 2;
+}
@@ -0,0 +1,36 @@
+#ifndef CLIPPER_HPP
+#define CLIPPER_HPP
+
+#include "math/m3.hpp"
+#include "math/v3.hpp"
+#include "ppcamera.hpp"
+
+#include <cstdint>
+#include <vector>
+
+// how far past the edges of the screen, in pixels, projected vertices may be before
+// their triangle gets clipped. triangles inside this are rasterized as they are,
+// since the rasterizer only visits their on screen bounds anyway. bigger ones
+// lose too much precision in the barycentric math, so they are cut down
+constexpr float GUARD_BAND = 2048.0f;
+
+// a piece of a triangle left after clipping, ready to rasterize
+struct ClippedTriangle {
+	// index of the triangle this came from
+	uint32_t triangle;
+	// projected vertices, the same as ProjectPoints would give
+	V3 p0, p1, p2;
+	// turns barycentric coordinates in this piece into ones in the original triangle,
+	// so shaders can interpolate the original vertex values
+	M3 toOriginal;
+};
+
+// true if a projected vertex (z < 0 if ProjectPoint failed) can be rasterized without clipping
+bool InsideGuardBand(const PPCamera &camera, const V3 &projected);
+
+// clip a camera space triangle (see PPCamera::CameraSpace) against the near plane and
+// the guard band, adding what is left to out as a fan of triangles.
+// returns how many triangles were added
+int ClipTriangle(const PPCamera &camera, uint32_t triangle, const V3 &q0, const V3 &q1, const V3 &q2, std::vector<ClippedTriangle> &out);
+
+#endif // CLIPPER_HPP
@@ -0,0 +1,278 @@
+#include "compact_mesh.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// value in [lo, hi] to [0, 65535], an empty range maps everything to 0
+static inline uint16_t Quantize16(float value, float lo, float hi) {
+	if (!(hi > lo)) return 0;
+	const float t = (value - lo) / (hi - lo) * 65535.0f + 0.5f;
+	return (uint16_t) std::clamp(t, 0.0f, 65535.0f);
+}
+
+static inline float SignNotZero(float x) {
+	return x < 0.0f ? -1.0f : 1.0f;
+}
+
+// fold the unit sphere onto the octahedron |x| + |y| + |z| = 1, then the
+// bottom half onto the corners of the square, giving two numbers in [-1, 1]
+static inline void OctahedralEncode(const V3 &n, int16_t out[2]) {
+	const float l1 = fabsf(n.x()) + fabsf(n.y()) + fabsf(n.z());
+	float u = 0.0f, v = 0.0f;
+	if (l1 > 0.0f) {
+		u = n.x() / l1;
+		v = n.y() / l1;
+		if (n.z() < 0.0f) {
+			const float fu = (1.0f - fabsf(v)) * SignNotZero(u);
+			const float fv = (1.0f - fabsf(u)) * SignNotZero(v);
+			u = fu;
+			v = fv;
+		}
+	}
+
+	out[0] = (int16_t) lroundf(std::clamp(u, -1.0f, 1.0f) * 32767.0f);
+	out[1] = (int16_t) lroundf(std::clamp(v, -1.0f, 1.0f) * 32767.0f);
+}
+
+static inline V3 OctahedralDecode(int16_t qu, int16_t qv) {
+	const float u = std::max(qu / 32767.0f, -1.0f);
+	const float v = std::max(qv / 32767.0f, -1.0f);
+
+	V3 n(u, v, 1.0f - fabsf(u) - fabsf(v));
+	if (n.z() < 0.0f) {
+		n.x() = (1.0f - fabsf(v)) * SignNotZero(u);
+		n.y() = (1.0f - fabsf(u)) * SignNotZero(v);
+	}
+	return n.Normalized();
+}
+
+static inline void PutVarint(std::vector<uint8_t> &out, uint32_t value) {
+	while (value >= 0x80) {
+		out.push_back((uint8_t) (value | 0x80));
+		value >>= 7;
+	}
+	out.push_back((uint8_t) value);
+}
+
+template <typename T>
+static inline void Put(std::vector<uint8_t> &out, const T &value) {
+	const uint8_t *bytes = (const uint8_t *) &value;
+	out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+void EncodeCompactMesh(std::vector<uint8_t> &out,
+	const V3 *vertices, const V3 *colors, const V3 *normals, const float *tcs, size_t vertexCount,
+	const unsigned int *triangles, size_t triangleCount) {
+
+	CompactMeshHeader header = {};
+	memcpy(header.magic, CompactMeshHeader::MAGIC, sizeof(header.magic));
+	header.version = CompactMeshHeader::VERSION;
+	header.flags = (colors ? CompactMeshHeader::HAS_COLORS : 0)
+		| (normals ? CompactMeshHeader::HAS_NORMALS : 0)
+		| (tcs ? CompactMeshHeader::HAS_TCS : 0);
+	header.vertexCount = (uint32_t) vertexCount;
+	header.triangleCount = (uint32_t) triangleCount;
+
+	for (int c = 0; c < 3; c++) {
+		header.min[c] = vertexCount ? vertices[0][c] : 0.0f;
+		header.max[c] = header.min[c];
+	}
+	for (size_t i = 1; i < vertexCount; i++) {
+		for (int c = 0; c < 3; c++) {
+			header.min[c] = std::min(header.min[c], vertices[i][c]);
+			header.max[c] = std::max(header.max[c], vertices[i][c]);
+		}
+	}
+
+	if (tcs && vertexCount) {
+		for (int c = 0; c < 2; c++) {
+			header.tcMin[c] = header.tcMax[c] = tcs[c];
+		}
+		for (size_t i = 1; i < vertexCount; i++) {
+			for (int c = 0; c < 2; c++) {
+				header.tcMin[c] = std::min(header.tcMin[c], tcs[2 * i + c]);
+				header.tcMax[c] = std::max(header.tcMax[c], tcs[2 * i + c]);
+			}
+		}
+
+		// a texture repeated many times, or a stray bad value, would get blurry
+		for (int c = 0; c < 2; c++) {
+			if (!(header.tcMax[c] - header.tcMin[c] <= CompactMeshHeader::MAX_QUANTIZED_TC_RANGE))
+				header.flags |= CompactMeshHeader::FLOAT_TCS;
+		}
+	}
+
+	out.clear();
+	Put(out, header);
+
+	for (size_t i = 0; i < vertexCount; i++) {
+		for (int c = 0; c < 3; c++) {
+			Put(out, Quantize16(vertices[i][c], header.min[c], header.max[c]));
+		}
+	}
+
+	if (colors) for (size_t i = 0; i < vertexCount; i++) {
+		for (int c = 0; c < 3; c++) {
+			out.push_back((uint8_t) std::clamp(colors[i][c] * 255.0f + 0.5f, 0.0f, 255.0f));
+		}
+	}
+
+	if (normals) for (size_t i = 0; i < vertexCount; i++) {
+		int16_t oct[2];
+		OctahedralEncode(normals[i], oct);
+		Put(out, oct);
+	}
+
+	if (header.flags & CompactMeshHeader::FLOAT_TCS) {
+		const uint8_t *bytes = (const uint8_t *) tcs;
+		out.insert(out.end(), bytes, bytes + vertexCount * 2 * sizeof(float));
+	} else if (tcs) for (size_t i = 0; i < vertexCount; i++) {
+		for (int c = 0; c < 2; c++) {
+			Put(out, Quantize16(tcs[2 * i + c], header.tcMin[c], header.tcMax[c]));
+		}
+	}
+
+	// neighbouring triangles share vertices, so indices are mostly close to the one
+	// before them and the differences fit in one or two bytes
+	const size_t sizeAt = out.size();
+	Put(out, (uint32_t) 0);
+
+	int64_t last = 0;
+	for (size_t i = 0; i < triangleCount * 3; i++) {
+		const int64_t delta = (int64_t) triangles[i] - last;
+		// zigzag, so small negative differences stay small too. shifted unsigned,
+		// since shifting a negative value left is undefined
+		PutVarint(out, (uint32_t) (((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63)));
+		last = triangles[i];
+	}
+
+	const uint32_t indexBytes = (uint32_t) (out.size() - sizeAt - sizeof(uint32_t));
+	memcpy(out.data() + sizeAt, &indexBytes, sizeof(indexBytes));
+}
+
+bool IsCompactMesh(const uint8_t *data, size_t size) {
+	return size >= sizeof(CompactMeshHeader::MAGIC) && memcmp(data, CompactMeshHeader::MAGIC, sizeof(CompactMeshHeader::MAGIC)) == 0;
+}
+
+CompactMeshDecoder::CompactMeshDecoder():
+	header(), positions(nullptr), colors(nullptr), normals(nullptr), tcs(nullptr),
+	indices(nullptr), indicesEnd(nullptr), lastIndex(0) {}
+
+bool CompactMeshDecoder::Open(const uint8_t *data, size_t size) {
+	*this = CompactMeshDecoder();
+
+	if (size < sizeof(header) || !IsCompactMesh(data, size)) return false;
+	memcpy(&header, data, sizeof(header));
+	if (header.version != CompactMeshHeader::VERSION) return false;
+
+	// hands out the next count elements, or nullptr if the data is too short
+	size_t offset = sizeof(header);
+	auto take = [&](size_t count, size_t elementSize) -> const uint8_t * {
+		if (count > (size - offset) / elementSize) return nullptr;
+		const uint8_t *p = data + offset;
+		offset += count * elementSize;
+		return p;
+	};
+
+	// every section has to fit before anything is sized from the counts
+	const size_t n = header.vertexCount;
+	if (!(positions = take(n, 3 * sizeof(uint16_t)))) return false;
+	if (HasColors() && !(colors = take(n, 3 * sizeof(uint8_t)))) return false;
+	if (HasNormals() && !(normals = take(n, 2 * sizeof(int16_t)))) return false;
+	const size_t tcSize = (header.flags & CompactMeshHeader::FLOAT_TCS) ? sizeof(float) : sizeof(uint16_t);
+	if (HasTcs() && !(tcs = take(n, 2 * tcSize))) return false;
+
+	const uint8_t *indexHeader = take(1, sizeof(uint32_t));
+	if (!indexHeader) return false;
+	uint32_t indexBytes;
+	memcpy(&indexBytes, indexHeader, sizeof(indexBytes));
+
+	// every index takes at least a byte
+	if (indexBytes < 3 * (size_t) header.triangleCount) return false;
+
+	if (!(indices = take(indexBytes, 1))) return false;
+	indicesEnd = indices + indexBytes;
+	return true;
+}
+
+void CompactMeshDecoder::DecodePositions(size_t first, size_t count, V3 *out) const {
+	// q / 65535 * (max - min) + min
+	V3 scale, offset;
+	for (int c = 0; c < 3; c++) {
+		scale[c] = (header.max[c] - header.min[c]) / 65535.0f;
+		offset[c] = header.min[c];
+	}
+
+	const uint8_t *src = positions + first * 3 * sizeof(uint16_t);
+	for (size_t i = 0; i < count; i++, src += 3 * sizeof(uint16_t)) {
+		uint16_t q[3];
+		memcpy(q, src, sizeof(q));
+		out[i] = V3(q[0] * scale[0] + offset[0], q[1] * scale[1] + offset[1], q[2] * scale[2] + offset[2]);
+	}
+}
+
+void CompactMeshDecoder::DecodeColors(size_t first, size_t count, V3 *out) const {
+	const uint8_t *src = colors + first * 3;
+	for (size_t i = 0; i < count; i++, src += 3) {
+		out[i] = V3(src[0], src[1], src[2]) / 255.0f;
+	}
+}
+
+void CompactMeshDecoder::DecodeNormals(size_t first, size_t count, V3 *out) const {
+	const uint8_t *src = normals + first * 2 * sizeof(int16_t);
+	for (size_t i = 0; i < count; i++, src += 2 * sizeof(int16_t)) {
+		int16_t q[2];
+		memcpy(q, src, sizeof(q));
+		out[i] = OctahedralDecode(q[0], q[1]);
+	}
+}
+
+void CompactMeshDecoder::DecodeTcs(size_t first, size_t count, float *out) const {
+	if (header.flags & CompactMeshHeader::FLOAT_TCS) {
+		memcpy(out, tcs + first * 2 * sizeof(float), count * 2 * sizeof(float));
+		return;
+	}
+
+	float scale[2];
+	for (int c = 0; c < 2; c++) {
+		scale[c] = (header.tcMax[c] - header.tcMin[c]) / 65535.0f;
+	}
+
+	const uint8_t *src = tcs + first * 2 * sizeof(uint16_t);
+	for (size_t i = 0; i < count; i++, src += 2 * sizeof(uint16_t)) {
+		uint16_t q[2];
+		memcpy(q, src, sizeof(q));
+		out[2 * i + 0] = q[0] * scale[0] + header.tcMin[0];
+		out[2 * i + 1] = q[1] * scale[1] + header.tcMin[1];
+	}
+}
+
+bool CompactMeshDecoder::DecodeTriangles(size_t count, unsigned int *out) {
+	for (size_t i = 0; i < count * 3; i++) {
+		// at most 5 bytes for 32 bits
+		uint32_t value = 0;
+		int shift = 0;
+		for (;;) {
+			if (indices == indicesEnd || shift > 28) {
+				indices = indicesEnd;
+				return false;
+			}
+			const uint8_t byte = *indices++;
+			value |= (uint32_t) (byte & 0x7f) << shift;
+			if (!(byte & 0x80)) break;
+			shift += 7;
+		}
+
+		const int64_t delta = (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+		lastIndex += delta;
+		// the rasterizer trusts these, so a bad one would read outside the vertices
+		if (lastIndex < 0 || lastIndex >= (int64_t) header.vertexCount) {
+			indices = indicesEnd;
+			return false;
+		}
+		out[i] = (unsigned int) lastIndex;
+	}
+
+	return true;
+}
@@ -0,0 +1,91 @@
+#ifndef COMPACT_MESH_HPP
+#define COMPACT_MESH_HPP
+
+#include "math/v3.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// the compact mesh file format, a third to a half of the size of a .bin:
+//   header (below)
+//   positions  uint16 x 3 per vertex, relative to the bounding box
+//   colors     uint8 x 3 per vertex, if present
+//   normals    int16 x 2 per vertex, octahedral, if present
+//   tcs        uint16 x 2 per vertex, relative to the texture coordinate range, if present.
+//              float x 2 instead if the range is too wide for 16 bits to be exact enough
+//   indices    uint32 byte count, then each index as a varint of the zigzagged
+//              difference from the index before it
+struct CompactMeshHeader {
+	char magic[4];
+	uint8_t version;
+	uint8_t flags;
+	uint16_t reserved;
+	uint32_t vertexCount;
+	uint32_t triangleCount;
+	// bounding box of the positions and range of the texture coordinates
+	float min[3], max[3];
+	float tcMin[2], tcMax[2];
+
+	static constexpr char MAGIC[4] = {'C', 'M', 'S', 'H'};
+	static constexpr uint8_t VERSION = 1;
+
+	enum Flags: uint8_t {
+		HAS_COLORS = 1,
+		HAS_NORMALS = 2,
+		HAS_TCS = 4,
+		FLOAT_TCS = 8,
+	};
+
+	// widest texture coordinate range that still gets quantized
+	static constexpr float MAX_QUANTIZED_TC_RANGE = 64.0f;
+};
+
+static_assert(sizeof(CompactMeshHeader) == 56, "the header is read straight from the file");
+
+// encode a mesh's arrays, colors/normals/tcs may be nullptr
+void EncodeCompactMesh(std::vector<uint8_t> &out,
+	const V3 *vertices, const V3 *colors, const V3 *normals, const float *tcs, size_t vertexCount,
+	const unsigned int *triangles, size_t triangleCount);
+
+// true if data starts like a compact mesh file
+bool IsCompactMesh(const uint8_t *data, size_t size);
+
+// decodes a compact mesh in place, without reading ahead. every vertex attribute
+// can be decoded in any pieces, in any order, straight into the float arrays
+// the mesh projects and draws from, so big meshes can be split between threads.
+// the triangles have to be decoded in order, since each index depends on the last
+struct CompactMeshDecoder {
+	CompactMeshHeader header;
+
+	CompactMeshDecoder();
+
+	// check the header, that every section fits in size and that the index data is long
+	// enough for the triangle count. the data has to stay around until decoding is done
+	bool Open(const uint8_t *data, size_t size);
+
+	inline size_t VertexCount(void) const { return header.vertexCount; }
+	inline size_t TriangleCount(void) const { return header.triangleCount; }
+	inline bool HasColors(void) const { return header.flags & CompactMeshHeader::HAS_COLORS; }
+	inline bool HasNormals(void) const { return header.flags & CompactMeshHeader::HAS_NORMALS; }
+	inline bool HasTcs(void) const { return header.flags & CompactMeshHeader::HAS_TCS; }
+
+	// vertices [first, first + count) into out[0, count)
+	void DecodePositions(size_t first, size_t count, V3 *out) const;
+	void DecodeColors(size_t first, size_t count, V3 *out) const;
+	void DecodeNormals(size_t first, size_t count, V3 *out) const;
+	// two floats per vertex
+	void DecodeTcs(size_t first, size_t count, float *out) const;
+
+	// the next count triangles, three indices each. false if the index data
+	// runs out or an index is not a vertex, after which nothing else decodes
+	bool DecodeTriangles(size_t count, unsigned int *out);
+
+private:
+	const uint8_t *positions, *colors, *normals, *tcs;
+	const uint8_t *indices, *indicesEnd;
+	// the last decoded index, deltas are from it
+	int64_t lastIndex;
+};
+
+#endif // COMPACT_MESH_HPP
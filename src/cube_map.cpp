@@ -1,15 +1,22 @@
 #include "cube_map.hpp"
 #include "ppcamera.hpp"
+#include "simd.hpp"
+#include <cmath>
 #include <iostream>
 
 CubeMap::CubeMap(const std::array<std::string, N> &sides):
-	cameras(), buffers(), lookupFace(0)
+	cameras(), buffers()
 {
 	for (size_t i = 0; i < N; i++) {
 		buffers[i].LoadFromTiff(sides[i].c_str());
 		cameras[i] = PPCamera(buffers[i].w, buffers[i].h, 90.0f);
 	}
 
+	PoseFaces(cameras);
+	UpdateFaces();
+}
+
+void CubeMap::PoseFaces(PPCamera *cameras) {
 	// camera 0 - forwards, no change
 	// camera 1 - left
 	cameras[1].RotateAroundDirection(V3(0, 1, 0), 90.0f);
@@ -23,25 +30,160 @@ CubeMap::CubeMap(const std::array<std::string, N> &sides):
 	cameras[5].RotateAroundDirection(V3(1, 0, 0), -90.0f);
 }
 
-CubeMap::CubeMap() {}
+CubeMap::CubeMap() {
+	UpdateFaces();
+}
+
+void CubeMap::UpdateFaces(void) {
+	bool used[N] = {};
+	axisAligned = true;
 
-V3 CubeMap::Lookup(const V3 &direction) {
-	V3 PP;
+	for (size_t i = 0; i < N; i++) {
+		const V3 &vd = viewDirections[i] = cameras[i].GetViewDirection();
+
+		int axis = 0;
+		if (std::fabs(vd[1]) > std::fabs(vd[axis])) axis = 1;
+		if (std::fabs(vd[2]) > std::fabs(vd[axis])) axis = 2;
+
+		const size_t slot = axis * 2 + (vd[axis] < 0.0f);
+		if (std::fabs(vd[axis]) < 0.999f || used[slot]) axisAligned = false;
+
+		used[slot] = true;
+		axisFaces[slot] = i;
+	}
+}
+
+size_t CubeMap::Face(const V3 &direction) const {
+	if (axisAligned) {
+		const V3 P = -direction;
 
-	for (size_t _i = 0; _i < N; _i++) {
-		size_t i = (_i + lookupFace) % N;
-
-		if (cameras[i].ProjectPoint(cameras[0].C - direction, PP) &&
-			PP.x() >= 0.0f &&
-			PP.y() >= 0.0f &&
-			PP.x() < buffers[i].w &&
-			PP.y() < buffers[i].h
-		) {
-			lookupFace = i;
-			return buffers[i].GetColorBilinear(PP.x(), PP.y());
+		// the biggest component picks the face directly
+		int axis = 0;
+		if (std::fabs(P[1]) > std::fabs(P[axis])) axis = 1;
+		if (std::fabs(P[2]) > std::fabs(P[axis])) axis = 2;
+
+		return axisFaces[axis * 2 + (P[axis] < 0.0f)];
+	}
+
+	size_t face = 0;
+	float best = -direction * viewDirections[0];
+
+	for (size_t i = 1; i < N; i++) {
+		const float d = -direction * viewDirections[i];
+		if (d > best) {
+			best = d;
+			face = i;
 		}
 	}
 
+	return face;
+}
+
+bool CubeMap::LookupFace(size_t face, const V3 &direction, V3 &color) const {
+	V3 PP;
+
+	if (cameras[face].ProjectCameraSpace(cameras[face].MInv * -direction, PP) &&
+		PP.x() >= 0.0f &&
+		PP.y() >= 0.0f &&
+		PP.x() < buffers[face].w &&
+		PP.y() < buffers[face].h
+	) {
+		color = buffers[face].GetColorBilinear(PP.x(), PP.y());
+		return true;
+	}
+
+	return false;
+}
+
+V3 CubeMap::Lookup(const V3 &direction) const {
+	V3 color;
+
+	// the face looking closest to the point always sees it
+	const size_t face = Face(direction);
+	if (LookupFace(face, direction, color)) return color;
+
+	// except for rounding right on an edge
+	for (size_t i = 0; i < N; i++) {
+		if (i != face && LookupFace(i, direction, color)) return color;
+	}
+
 	// should never get here... return a shocking color
 	return V3(0.5, 0, 1);
 }
+
+void CubeMap::Lookup(const V3 *directions, V3 *colors, size_t count) const {
+	size_t i = 0;
+
+#if SIMD_X86
+	// picks faces and projects 4 directions at once. the bilinear filtering
+	// reads from a different face per lane, so it stays scalar
+	if (axisAligned && GetSimdLevel() >= SIMD_SSE) {
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+
+		for (; i + 4 <= count; i += 4) {
+			const V3 *d = directions + i;
+
+			// P = -direction
+			const __m128 px = _mm_setr_ps(-d[0].x(), -d[1].x(), -d[2].x(), -d[3].x());
+			const __m128 py = _mm_setr_ps(-d[0].y(), -d[1].y(), -d[2].y(), -d[3].y());
+			const __m128 pz = _mm_setr_ps(-d[0].z(), -d[1].z(), -d[2].z(), -d[3].z());
+
+			// same choice as Face: x unless y or z is strictly bigger, then y unless z is
+			const __m128 ax = _mm_and_ps(px, absMask);
+			const __m128 ay = _mm_and_ps(py, absMask);
+			const __m128 az = _mm_and_ps(pz, absMask);
+			const int yMajor = _mm_movemask_ps(_mm_and_ps(_mm_cmpgt_ps(ay, ax), _mm_cmpge_ps(ay, az)));
+			const int zMajor = _mm_movemask_ps(_mm_and_ps(_mm_cmpgt_ps(az, ax), _mm_cmpgt_ps(az, ay)));
+			const int negative[3] = {
+				_mm_movemask_ps(_mm_cmplt_ps(px, zero)),
+				_mm_movemask_ps(_mm_cmplt_ps(py, zero)),
+				_mm_movemask_ps(_mm_cmplt_ps(pz, zero)),
+			};
+
+			size_t faces[4];
+			for (int lane = 0; lane < 4; lane++) {
+				const int axis = (zMajor >> lane & 1) ? 2 : (yMajor >> lane & 1) ? 1 : 0;
+				faces[lane] = axisFaces[axis * 2 + (negative[axis] >> lane & 1)];
+			}
+
+			// q = MInv * P, each lane with its own face's matrix
+			__m128 q[3];
+			for (int r = 0; r < 3; r++) {
+				const V3 &m0 = cameras[faces[0]].MInv[r], &m1 = cameras[faces[1]].MInv[r];
+				const V3 &m2 = cameras[faces[2]].MInv[r], &m3 = cameras[faces[3]].MInv[r];
+
+				q[r] = _mm_add_ps(_mm_add_ps(
+					_mm_mul_ps(_mm_setr_ps(m0[0], m1[0], m2[0], m3[0]), px),
+					_mm_mul_ps(_mm_setr_ps(m0[1], m1[1], m2[1], m3[1]), py)),
+					_mm_mul_ps(_mm_setr_ps(m0[2], m1[2], m2[2], m3[2]), pz));
+			}
+
+			const __m128 u = _mm_div_ps(q[0], q[2]);
+			const __m128 v = _mm_div_ps(q[1], q[2]);
+			const __m128 w = _mm_setr_ps(buffers[faces[0]].w, buffers[faces[1]].w, buffers[faces[2]].w, buffers[faces[3]].w);
+			const __m128 h = _mm_setr_ps(buffers[faces[0]].h, buffers[faces[1]].h, buffers[faces[2]].h, buffers[faces[3]].h);
+
+			__m128 inside = _mm_cmpgt_ps(q[2], _mm_set1_ps(PPCamera::NEAR_Z));
+			inside = _mm_and_ps(inside, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmpge_ps(v, zero)));
+			inside = _mm_and_ps(inside, _mm_and_ps(_mm_cmplt_ps(u, w), _mm_cmplt_ps(v, h)));
+			const int insideMask = _mm_movemask_ps(inside);
+
+			alignas(16) float us[4], vs[4];
+			_mm_store_ps(us, u);
+			_mm_store_ps(vs, v);
+
+			for (int lane = 0; lane < 4; lane++) {
+				if (insideMask >> lane & 1)
+					colors[i + lane] = buffers[faces[lane]].GetColorBilinear(us[lane], vs[lane]);
+				else
+					colors[i + lane] = Lookup(d[lane]);
+			}
+		}
+	}
+#endif
+
+	for (; i < count; i++) {
+		colors[i] = Lookup(directions[i]);
+	}
+}
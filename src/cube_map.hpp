@@ -12,16 +12,36 @@ struct CubeMap {
 
 	PPCamera cameras[N];
 	FrameBuffer buffers[N];
-
-	// index to check first
-	size_t lookupFace;
+	// view direction of each camera, used to pick the face a lookup lands on
+	V3 viewDirections[N];
+	// when every face looks down a world axis, the face for each axis, indexed by
+	// axis * 2 + 1 if the direction points the negative way. lets Face skip the dot products
+	bool axisAligned;
+	size_t axisFaces[N];
 
 	// load from side paths
 	CubeMap(const std::array<std::string, N> &sides);
 
 	CubeMap();
 
-	V3 Lookup(const V3 &direction);
+	// turn N new 90 degree cameras into the faces, in the order the sides are loaded
+	static void PoseFaces(PPCamera *cameras);
+
+	// recompute viewDirections, call after rotating the cameras
+	void UpdateFaces(void);
+
+	// the face whose camera looks the most along -direction
+	size_t Face(const V3 &direction) const;
+
+	// lookups assume the cameras share a center, which they do for any real cube map.
+	// both are safe to call from several threads at once
+	V3 Lookup(const V3 &direction) const;
+	// colors[i] = Lookup(directions[i]), several at a time
+	void Lookup(const V3 *directions, V3 *colors, size_t count) const;
+
+private:
+	// false if direction misses the face
+	bool LookupFace(size_t face, const V3 &direction, V3 &color) const;
 };
 
 #endif
\ No newline at end of file
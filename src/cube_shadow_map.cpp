@@ -0,0 +1,65 @@
+#include "cube_shadow_map.hpp"
+#include "thread_pool.hpp"
+
+#include <cmath>
+
+// the index of the biggest component of v
+static inline int MajorAxis(const V3 &v) {
+	int axis = 0;
+	if (std::fabs(v[1]) > std::fabs(v[axis])) axis = 1;
+	if (std::fabs(v[2]) > std::fabs(v[axis])) axis = 2;
+	return axis;
+}
+
+CubeShadowMap::CubeShadowMap(int size) {
+	for (size_t i = 0; i < N; i++) {
+		cameras[i] = PPCamera(size, size, 90.0f);
+		faces[i].Resize(size, size);
+	}
+
+	CubeMap::PoseFaces(cameras);
+
+	for (size_t i = 0; i < N; i++) {
+		const V3 vd = cameras[i].GetViewDirection();
+		const int axis = MajorAxis(vd);
+		axisFaces[axis * 2 + (vd[axis] < 0.0f)] = i;
+	}
+}
+
+void CubeShadowMap::SetCenter(const V3 &center) {
+	for (size_t i = 0; i < N; i++) cameras[i].C = center;
+}
+
+void CubeShadowMap::SetFilter(ShadowSampler::Filter filter, int kernel) {
+	for (size_t i = 0; i < N; i++) {
+		samplers[i].filter = filter;
+		samplers[i].kernel = kernel;
+	}
+}
+
+void CubeShadowMap::Render(const std::vector<const Mesh *> &meshes) {
+	// the draws inside run serially on each face's thread, so the
+	// faces only wait for each other once instead of once per mesh
+	ThreadPool::Global().ParallelFor(N, [&](size_t face) {
+		faces[face].Clear(0);
+		for (const Mesh *mesh : meshes) mesh->DrawDepthOnly(faces[face], cameras[face], scratch[face]);
+		samplers[face].Prepare(faces[face]);
+	});
+}
+
+size_t CubeShadowMap::Face(const V3 &direction) const {
+	const int axis = MajorAxis(direction);
+	return axisFaces[axis * 2 + (direction[axis] < 0.0f)];
+}
+
+float CubeShadowMap::Lit(const V3 &d, float s, float epsilon) const {
+	const size_t face = Face(d);
+
+	// the face's camera space times s, with w the distance along its view direction
+	const V3 q = cameras[face].MInv * d;
+	// only the light's own position is in no face
+	if (!(q.z() > PPCamera::NEAR_Z * s)) return 1.0f;
+
+	const float r = 1.0f / q.z();
+	return samplers[face].Lit(q.x() * r, q.y() * r, s * r, epsilon);
+}
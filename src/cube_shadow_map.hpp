@@ -0,0 +1,52 @@
+#ifndef CUBE_SHADOW_MAP_HPP
+#define CUBE_SHADOW_MAP_HPP
+
+#include "cube_map.hpp"
+#include "frame_buffer.hpp"
+#include "math/v3.hpp"
+#include "mesh.hpp"
+#include "ppcamera.hpp"
+#include "shadow_sampler.hpp"
+
+#include <vector>
+
+// shadows from a point light in every direction: six 90 degree depth buffers around
+// the light, posed like the faces of a CubeMap, so every point is in exactly one of them
+struct CubeShadowMap {
+	static const constexpr size_t N = CubeMap::N;
+
+	PPCamera cameras[N];
+	DepthBuffer faces[N];
+	// each face ready for shadow tests, Render prepares them
+	ShadowSampler samplers[N];
+
+	// faces of size x size texels
+	CubeShadowMap(int size);
+
+	// the light's position
+	inline const V3 &Center(void) const { return cameras[0].C; }
+	void SetCenter(const V3 &center);
+
+	// filter every face's shadow tests the same way
+	void SetFilter(ShadowSampler::Filter filter, int kernel);
+
+	// clear every face and draw the depth of meshes into it, the faces on separate threads
+	void Render(const std::vector<const Mesh *> &meshes);
+
+	// the face that sees direction from the center. the biggest component of direction
+	// picks it, the same as CubeMap::Face for axis aligned faces
+	size_t Face(const V3 &direction) const;
+
+	// ShadowSampler::Lit for the world point Center() + d / s, from the face it is in.
+	// s is any positive number, so callers can skip dividing by their own w. filter
+	// kernels stop at the edge of their face instead of carrying on into the next one
+	float Lit(const V3 &d, float s, float epsilon) const;
+
+private:
+	// the face looking down each axis, indexed by axis * 2 + 1 if it looks the negative way
+	size_t axisFaces[N];
+	// per face, so the faces can be drawn at the same time
+	DrawScratch scratch[N];
+};
+
+#endif // CUBE_SHADOW_MAP_HPP
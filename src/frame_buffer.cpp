@@ -3,13 +3,29 @@
 #include "font.hpp"
 #include "ppcamera.hpp"
 #include "cube_map.hpp"
+#include "thread_pool.hpp"
 
 #include <cassert>
 #include <cmath>
+#include <new>
 #include <tiff.h>
 #include <tiffio.h>
 
-FrameBuffer::FrameBuffer(unsigned width, unsigned height): cb(nullptr), zb(nullptr) {
+// cb and zb start on a cache line
+constexpr size_t BUFFER_ALIGNMENT = 64;
+
+template <typename T>
+static T *AllocateAligned(size_t count) {
+	return static_cast<T *>(::operator new[](count * sizeof(T), std::align_val_t(BUFFER_ALIGNMENT)));
+}
+
+static void FreeAligned(void *buffer) {
+	::operator delete[](buffer, std::align_val_t(BUFFER_ALIGNMENT));
+}
+
+FrameBuffer::FrameBuffer(unsigned width, unsigned height, bool depthOnly):
+	layout(LAYOUT_LINEAR), cb(nullptr), depthOnly(depthOnly), zb(nullptr), hizFar(nullptr), hizDirty(nullptr), tileGeneration(nullptr)
+{
 	Resize(width, height);
 }
 
@@ -18,8 +34,11 @@ FrameBuffer::FrameBuffer(): FrameBuffer(1, 1) {
 }
 
 FrameBuffer::~FrameBuffer() {
-	if (cb) delete[] cb;
-	if (zb) delete[] zb;
+	if (cb) FreeAligned(cb);
+	if (zb) FreeAligned(zb);
+	if (hizFar) delete[] hizFar;
+	if (hizDirty) delete[] hizDirty;
+	if (tileGeneration) delete[] tileGeneration;
 }
 
 void FrameBuffer::Resize(unsigned width, unsigned height) {
@@ -27,15 +46,45 @@ void FrameBuffer::Resize(unsigned width, unsigned height) {
 	h = (int) height;
 
 	// free the old ones if they existed
-	if (cb) delete[] cb;
-	if (zb) delete[] zb;
+	if (cb) FreeAligned(cb);
+	if (zb) FreeAligned(zb);
+	if (hizFar) delete[] hizFar;
+	if (hizDirty) delete[] hizDirty;
+	if (tileGeneration) delete[] tileGeneration;
+
+	// both layouts get room for whole tiles, so switching layout doesn't reallocate
+	tilesX = (w + LAYOUT_TILE - 1) / LAYOUT_TILE;
+	tilesY = (h + LAYOUT_TILE - 1) / LAYOUT_TILE;
 
 	// create the new framebuffer. undefined contents
-	cb = new uint32_t [w*h];
-	assert(cb != nullptr && "color buffer allocation failed");
+	cb = nullptr;
+	if (!depthOnly) {
+		cb = AllocateAligned<uint32_t>(BufferSize());
+		assert(cb != nullptr && "color buffer allocation failed");
+	}
 
-	zb = new float [w * h];
+	zb = AllocateAligned<float>(BufferSize());
 	assert(zb != nullptr && "z buffer allocation failed");
+
+	// partial blocks on the right and bottom edges count too
+	hizW = (w + HIZ_TILE - 1) / HIZ_TILE;
+	hizH = (h + HIZ_TILE - 1) / HIZ_TILE;
+
+	hizFar = new float [hizW * hizH];
+	assert(hizFar != nullptr && "hierarchical z buffer allocation failed");
+
+	hizDirty = new uint8_t [hizW * hizH];
+	assert(hizDirty != nullptr && "hierarchical z buffer allocation failed");
+
+	HiZInvalidate();
+
+	// nothing is waiting for a clear yet
+	tileGeneration = new uint32_t [hizW * hizH];
+	assert(tileGeneration != nullptr && "tile generation allocation failed");
+
+	clearColor = 0;
+	clearGeneration = 0;
+	std::fill(tileGeneration, tileGeneration + hizW * hizH, clearGeneration);
 }
 
 // copied and modified from framebuffer.cpp example code
@@ -55,8 +104,9 @@ bool FrameBuffer::SaveToTiff(const char *path) const {
 	TIFFSetField(out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
 	TIFFSetField(out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
 
+	const uint32_t *colors = LinearColors();
 	for (int row = 0; row < h; row++) {
-		TIFFWriteScanline(out, &cb[row * w], row);
+		TIFFWriteScanline(out, (void *) &colors[row * w], row);
 	}
 
 	TIFFClose(out);
@@ -79,12 +129,29 @@ bool FrameBuffer::LoadFromTiff(const char *path) {
 		Resize(width, height);
 	}
 
-	if (TIFFReadRGBAImageOriented(in, w, h, cb, ORIENTATION_TOPLEFT, 0) == 0) {
+	ResolveClear();
+
+	// libtiff reads row major
+	uint32_t *colors = cb;
+	if (layout != LAYOUT_LINEAR) {
+		linearColors.resize(w * h);
+		colors = linearColors.data();
+	}
+
+	if (TIFFReadRGBAImageOriented(in, w, h, colors, ORIENTATION_TOPLEFT, 0) == 0) {
 		TIFFClose(in);
 		fprintf(stderr, "error: could not load tiff from %s\n", path);
 		return false;
 	}
 
+	if (colors != cb) {
+		for (int v = 0; v < h; v++) {
+			for (int u = 0; u < w; u++) {
+				cb[Index(u, v)] = colors[u + v * w];
+			}
+		}
+	}
+
 	TIFFClose(in);
 	return true;
 }
@@ -94,7 +161,8 @@ void FrameBuffer::SetPixel(int u, int v, uint32_t color) {
 	if (u < w && v < h && u >= 0 && v >= 0) {
 #endif
 
-	cb[u + v * w] = color;
+	if (ClearPending(u, v)) ResolveTile(u / HIZ_TILE, v / HIZ_TILE);
+	cb[Index(u, v)] = color;
 
 #ifdef WINDOW_SAFE
 	} else {
@@ -105,42 +173,115 @@ void FrameBuffer::SetPixel(int u, int v, uint32_t color) {
 }
 
 void FrameBuffer::Clear(uint32_t color) {
-	// clear color buffer
-	size_t pixelCount = w * h;
-	for (size_t uv = 0; uv < pixelCount; uv++) {
-		cb[uv] = color;
+	// every block is now behind, see ResolveTile for the actual clearing
+	clearColor = color;
+	clearGeneration++;
+
+	// the z buffer will be all 0s
+	memset(hizFar, 0, hizW * hizH * sizeof(*hizFar));
+	memset(hizDirty, 0, hizW * hizH * sizeof(*hizDirty));
+}
+
+void FrameBuffer::ClearZ(const ScreenRect &rect) {
+	const ScreenRect r = rect.Intersect(Bounds());
+	if (r.Empty()) return;
+
+	for (int tileY = r.top / HIZ_TILE; tileY <= r.bottom / HIZ_TILE; tileY++) {
+		for (int tileX = r.left / HIZ_TILE; tileX <= r.right / HIZ_TILE; tileX++) {
+			if (tileGeneration[tileX + tileY * hizW] != clearGeneration) ResolveTile(tileX, tileY);
+			HiZMarkDirty(tileX * HIZ_TILE, tileY * HIZ_TILE);
+		}
 	}
 
-	// clear z buffer
-	memset(zb, 0, pixelCount * sizeof(*zb));
+	for (int v = r.top; v <= r.bottom; v++) {
+		for (int u = r.left; u <= r.right; u++) {
+			zb[Index(u, v)] = 0.0f;
+		}
+	}
 }
 
-void FrameBuffer::Clear(CubeMap &map, const PPCamera &camera) {
-	memset(zb, 0, w * h * sizeof(*zb));
+void FrameBuffer::ResolveTile(int tileX, int tileY) const {
+	const int left = tileX * HIZ_TILE;
+	const int top = tileY * HIZ_TILE;
+	const int right = std::min(left + HIZ_TILE, w);
+	const int bottom = std::min(top + HIZ_TILE, h);
 
-	for (int v = 0; v < h; v++) {
-		for (int u = 0; u < w; u++) {
-			const V3 ray = camera.a * u + camera.b * v + camera.c;
-			cb[u + v * w] = ColorFromV3(map.Lookup(-ray));
+	for (int v = top; v < bottom; v++) {
+		for (int u = left; u < right; u++) {
+			zb[Index(u, v)] = 0.0f;
+		}
+	}
+
+	if (cb) for (int v = top; v < bottom; v++) {
+		for (int u = left; u < right; u++) {
+			cb[Index(u, v)] = clearColor;
 		}
 	}
+
+	tileGeneration[tileX + tileY * hizW] = clearGeneration;
+}
+
+void FrameBuffer::ResolveClear(void) const {
+	for (int tileY = 0; tileY < hizH; tileY++) {
+		for (int tileX = 0; tileX < hizW; tileX++) {
+			if (tileGeneration[tileX + tileY * hizW] != clearGeneration) ResolveTile(tileX, tileY);
+		}
+	}
+}
+
+void FrameBuffer::Clear(CubeMap &map, const PPCamera &camera, bool depthPrepass) {
+	map.UpdateFaces();
+
+	ThreadPool::Global().ParallelFor(h, [&](size_t row) {
+		const int v = (int) row;
+
+		// pixels in this row that need the cube map, looked up together afterwards
+		static thread_local std::vector<int> columns;
+		static thread_local std::vector<V3> directions, colors;
+		columns.clear();
+		directions.clear();
+
+		// step the ray along the row instead of rebuilding it for every pixel
+		V3 ray = camera.b * v + camera.c;
+		for (int u = 0; u < w; u++, ray += camera.a) {
+			// covered pixels get drawn over anyway
+			if (depthPrepass && !ClearPending(u, v) && zb[Index(u, v)] != 0.0f) continue;
+
+			columns.push_back(u);
+			directions.push_back(-ray);
+		}
+
+		colors.resize(directions.size());
+		map.Lookup(directions.data(), colors.data(), directions.size());
+
+		for (size_t i = 0; i < columns.size(); i++) {
+			cb[Index(columns[i], v)] = ColorFromV3(colors[i]);
+		}
+	});
+
+	memset(zb, 0, BufferSize() * sizeof(*zb));
+	memset(hizFar, 0, hizW * hizH * sizeof(*hizFar));
+	memset(hizDirty, 0, hizW * hizH * sizeof(*hizDirty));
+
+	// every pixel has been written
+	std::fill(tileGeneration, tileGeneration + hizW * hizH, clearGeneration);
 }
 
 float FrameBuffer::GetZ(int u, int v) const {
 	if (u >= 0 && v >= 0 && u < w && v < h)
-		return zb[u + v * w];
+		return ClearPending(u, v) ? 0.0f : zb[Index(u, v)];
 	else
 	 	return 0.0f;
 }
 
 V3 FrameBuffer::GetColorI(int x, int y) const {
 	if (x >= 0 && y >= 0 && x < w && y < h)
-		return V3FromColor(cb[x + y * w]);
+		return V3FromColor(ClearPending(x, y) ? clearColor : cb[Index(x, y)]);
 	else
 	 	return V3();
 }
 
-V3 FrameBuffer::GetColor(float x, float y, bool repeat, bool bilinear) {
+V3 FrameBuffer::GetColor(float x, float y, bool repeat, bool bilinear) const {
 	int u, v;
 
 	if (repeat) {
@@ -168,7 +309,7 @@ V3 FrameBuffer::GetColor(float x, float y, bool repeat, bool bilinear) {
 	}
 }
 
-V3 FrameBuffer::GetColorBilinear(float x, float y) {
+V3 FrameBuffer::GetColorBilinear(float x, float y) const {
 	int centerU = (int) floorf(x + 0.5f);
 	int centerV = (int) floorf(y + 0.5f);
 
@@ -428,10 +569,12 @@ void FrameBuffer::SetPixel(int u, int v, float z, const V3 &color) {
 	if (u < w && v < h && u >= 0 && v >= 0) {
 #endif
 
-	int i = u + v * w;
+	if (ClearPending(u, v)) ResolveTile(u / HIZ_TILE, v / HIZ_TILE);
+	int i = Index(u, v);
 
 	if (z > zb[i]) {
 		zb[i] = z;
+		HiZMarkDirty(u, v);
 		cb[i] = ColorFromV3(color);
 	}
 
@@ -447,10 +590,12 @@ void FrameBuffer::SetPixel(int u, int v, float z, uint32_t color) {
 	if (u < w && v < h && u >= 0 && v >= 0) {
 #endif
 
-	int i = u + v * w;
+	if (ClearPending(u, v)) ResolveTile(u / HIZ_TILE, v / HIZ_TILE);
+	int i = Index(u, v);
 
 	if (z > zb[i]) {
 		zb[i] = z;
+		HiZMarkDirty(u, v);
 		cb[i] = color;
 	}
 
@@ -470,10 +615,12 @@ void FrameBuffer::DrawZBuffer(const FrameBuffer &o) {
 	int width = std::min(w, o.w);
 	int height = std::min(h, o.h);
 
+	o.ResolveClear();
+
 	// copy inverse z values over, converting them to a grayscale representation
 	for (int v = 0; v < height; v++) {
 		for (int u = 0; u < width; u++) {
-			SetPixel(u, v, ColorFromInverseZ(o.zb[v * o.w + u]));
+			SetPixel(u, v, ColorFromInverseZ(o.zb[o.Index(u, v)]));
 		}
 	}
 }
@@ -483,23 +630,41 @@ void FrameBuffer::Copy(const FrameBuffer &o) {
 	int width = std::min(w, o.w);
 	int height = std::min(h, o.h);
 
-	// copy inverse z values over, converting them to a grayscale representation
-	for (int v = 0; v < height; v++) {
-		memcpy(cb + v * w, o.cb + v * o.w, width * sizeof(*cb));
-		memcpy(zb + v * w, o.zb + v * o.w, width * sizeof(*zb));
+	ResolveClear();
+	o.ResolveClear();
+
+	// depth only buffers just copy z
+	const bool colors = cb && o.cb;
+
+	if (layout == LAYOUT_LINEAR && o.layout == LAYOUT_LINEAR) {
+		for (int v = 0; v < height; v++) {
+			if (colors) memcpy(cb + v * w, o.cb + v * o.w, width * sizeof(*cb));
+			memcpy(zb + v * w, o.zb + v * o.w, width * sizeof(*zb));
+		}
+	} else {
+		for (int v = 0; v < height; v++) {
+			for (int u = 0; u < width; u++) {
+				if (colors) cb[Index(u, v)] = o.cb[o.Index(u, v)];
+				zb[Index(u, v)] = o.zb[o.Index(u, v)];
+			}
+		}
 	}
+
+	HiZInvalidate();
 }
 
 void FrameBuffer::DrawPointCloud(const PPCamera &camera, const FrameBuffer &other, const PPCamera &otherCamera) {
 	V3 P, PP;
+	other.ResolveClear();
+
 	for (int v = 0; v < other.h; v++) {
 		for (int u = 0; u < other.w; u++) {
-			float z = other.zb[v * other.w + u];
+			float z = other.zb[other.Index(u, v)];
 			if (z == 0.0f) continue;
 			P = otherCamera.UnprojectPoint(u, v, z);
 
 			if (camera.ProjectPoint(P, PP) && PP.x() >= 0.0f && PP.y() >= 0.0f && PP.x() < w && PP.y() < h)
-				SetPixel(PP, other.cb[v * other.w + u]);
+				SetPixel(PP, other.cb[other.Index(u, v)]);
 		}
 	}
 }
@@ -608,88 +773,110 @@ void FrameBuffer::DrawTriangle(const PPCamera &camera,
 
 }
 
-void FrameBuffer::DrawTriangle(const V3 &p0, const V3 &p1, const V3 &p2, FragShaderFn frag) {
-	auto [bbLeft, bbRight] = std::minmax({p0.x(), p1.x(), p2.x()});
-	auto [bbTop, bbBottom] = std::minmax({p0.y(), p1.y(), p2.y()});
+float FrameBuffer::HiZFarthest(int tileX, int tileY) {
+	const int tile = tileX + tileY * hizW;
+	if (!hizDirty[tile]) return hizFar[tile];
 
-	// clip box to window and get point coordinates
-	int left = (int) (std::max(bbLeft, 0.0f) - 0.5f);
-	int right = (int) (std::min(bbRight, (float) w - 1) + 0.5f);
-	int top = (int) (std::max(bbTop, 0.0f) - 0.5f);
-	int bottom = (int) (std::min(bbBottom, (float) h - 1) + 0.5f);
+	const int left = tileX * HIZ_TILE;
+	const int top = tileY * HIZ_TILE;
+	const int right = std::min(left + HIZ_TILE, w);
+	const int bottom = std::min(top + HIZ_TILE, h);
 
-	float dy12 = p1.y() - p2.y();
-	float dy20 = p2.y() - p0.y();
-	float dx21 = p2.x() - p1.x();
-	float dx02 = p0.x() - p2.x();
-	float div = dy12 * dx02 + dx21 * (p0.y() - p2.y());
+	float farthest = zb[Index(left, top)];
+	for (int v = top; v < bottom; v++) {
+		for (int u = left; u < right; u++) {
+			farthest = std::min(farthest, zb[Index(u, v)]);
+		}
+	}
 
-	float B0y = (top - p2.y()) * dx21 - dy12 * p2.x();
-	float B1y = (top - p2.y()) * dx02 - dy20 * p2.x();
+	hizFar[tile] = farthest;
+	hizDirty[tile] = 0;
+	return farthest;
+}
 
-	B0y /= div; B1y /= div; dx21 /= div; dx02 /= div; dy12 /= div; dy20 /= div;
+void FrameBuffer::HiZMarkDirty(int u, int v) {
+	hizDirty[u / HIZ_TILE + (v / HIZ_TILE) * hizW] = 1;
+}
 
-	V3 B;
+void FrameBuffer::HiZInvalidate(void) {
+	memset(hizDirty, 1, hizW * hizH * sizeof(*hizDirty));
+}
 
-	for (int currPixY = top; currPixY <= bottom; currPixY++, B0y += dx21, B1y += dx02) {
-		B[0] = B0y + left * dy12;
-		B[1] = B1y + left * dy20;
-		B[2] = 1.0f - B[0] - B[1];
-
-		for (int currPixX = left; currPixX <= right; currPixX++, B[0] += dy12, B[1] += dy20, B[2] -= dy12 + dy20) {
-			if (B[0] >= 0 && B[1] >= 0 && B[2] >= 0) {
-				float z = p0.z() * B[0] + p1.z() * B[1] + p2.z() * B[2];
-				int bufferIndex = currPixX + currPixY * w;
-
-				if (z > zb[bufferIndex]) {
-					zb[bufferIndex] = z;
-					cb[bufferIndex] = ColorFromV3(frag(B, z, currPixX, currPixY));
-				}
-			}
+size_t FrameBuffer::BufferSize(void) const {
+	return (size_t) tilesX * tilesY * LAYOUT_TILE * LAYOUT_TILE;
+}
+
+void FrameBuffer::SetLayout(Layout newLayout) {
+	if (newLayout == layout) return;
+
+	ResolveClear();
+
+	uint32_t *newCb = cb ? AllocateAligned<uint32_t>(BufferSize()) : nullptr;
+	float *newZb = AllocateAligned<float>(BufferSize());
+
+	for (int v = 0; v < h; v++) {
+		for (int u = 0; u < w; u++) {
+			const int from = Index(u, v);
+			const int to = Index(newLayout, u, v);
+
+			if (cb) newCb[to] = cb[from];
+			newZb[to] = zb[from];
 		}
 	}
+
+	if (cb) FreeAligned(cb);
+	FreeAligned(zb);
+	cb = newCb;
+	zb = newZb;
+	layout = newLayout;
 }
 
-// TODO: in some cases, there is a diagonal black line across the texture
-void FrameBuffer::DrawTriangleCorrect(const V3 &p0, const V3 &p1, const V3 &p2, FragShaderFn frag) {
+const uint32_t *FrameBuffer::LinearColors(void) const {
+	assert(cb != nullptr && "depth only buffers have no colors");
+	ResolveClear();
+
+	if (layout == LAYOUT_LINEAR) return cb;
+
+	linearColors.resize(w * h);
+	for (int v = 0; v < h; v++) {
+		for (int u = 0; u < w; u++) {
+			linearColors[u + v * w] = cb[Index(u, v)];
+		}
+	}
+
+	return linearColors.data();
+}
+
+ScreenRect FrameBuffer::Bounds(void) const {
+	return ScreenRect{0, 0, w - 1, h - 1};
+}
+
+ScreenRect FrameBuffer::TriangleBounds(const V3 &p0, const V3 &p1, const V3 &p2) const {
 	auto [bbLeft, bbRight] = std::minmax({p0.x(), p1.x(), p2.x()});
 	auto [bbTop, bbBottom] = std::minmax({p0.y(), p1.y(), p2.y()});
 
-	// clip box to window and get point coordinates
-	// TODO: if bbleft == 0 then left = -0.5 which is outside window. that is bad, same with (bb)top
-	int left = (int) (std::max(bbLeft, 0.0f) - 0.5f);
-	int right = (int) (std::min(bbRight, (float) w - 1) + 0.5f);
-	int top = (int) (std::max(bbTop, 0.0f) - 0.5f);
-	int bottom = (int) (std::min(bbBottom, (float) h - 1) + 0.5f);
-
-	float dy12 = p1.y() - p2.y();
-	float dy20 = p2.y() - p0.y();
-	float dx21 = p2.x() - p1.x();
-	float dx02 = p0.x() - p2.x();
-	float div = dy12 * dx02 + dx21 * (p0.y() - p2.y());
+	// clip box to window. pixels are sampled at integer coordinates, rounding outwards
+	// covers the vertices moving when they are snapped to sub-pixels
+	return ScreenRect{
+		(int) std::floor(std::max(bbLeft, 0.0f)),
+		(int) std::floor(std::max(bbTop, 0.0f)),
+		(int) std::ceil(std::min(bbRight, (float) w - 1)),
+		(int) std::ceil(std::min(bbBottom, (float) h - 1))
+	};
+}
 
-	float B0y = (top - p2.y()) * dx21 - dy12 * p2.x();
-	float B1y = (top - p2.y()) * dx02 - dy20 * p2.x();
+void FrameBuffer::DrawTriangle(const V3 &p0, const V3 &p1, const V3 &p2, FragShaderFn frag) {
+	DrawTriangle(p0, p1, p2, frag, Bounds());
+}
 
-	B0y /= div; B1y /= div; dx21 /= div; dx02 /= div; dy12 /= div; dy20 /= div;
+void FrameBuffer::DrawTriangle(const V3 &p0, const V3 &p1, const V3 &p2, FragShaderFn frag, const ScreenRect &clip) {
+	DrawTriangle<FragShaderFn>(p0, p1, p2, frag, clip);
+}
 
-	V3 B;
+void FrameBuffer::DrawTriangleCorrect(const V3 &p0, const V3 &p1, const V3 &p2, FragShaderFn frag) {
+	DrawTriangleCorrect(p0, p1, p2, frag, Bounds());
+}
 
-	for (int currPixY = top; currPixY <= bottom; currPixY++, B0y += dx21, B1y += dx02) {
-		B[0] = B0y + left * dy12;
-		B[1] = B1y + left * dy20;
-		B[2] = 1.0f - B[0] - B[1];
-
-		for (int currPixX = left; currPixX <= right; currPixX++, B[0] += dy12, B[1] += dy20, B[2] -= dy12 + dy20) {
-			if (B[0] >= 0 && B[1] >= 0 && B[2] >= 0) {
-				float z = p0.z() * B[0] + p1.z() * B[1] + p2.z() * B[2];
-				int bufferIndex = currPixX + currPixY * w;
-
-				if (z > zb[bufferIndex]) {
-					zb[bufferIndex] = z;
-					cb[bufferIndex] = ColorFromV3(frag(B, z, currPixX, currPixY));
-				}
-			}
-		}
-	}
+void FrameBuffer::DrawTriangleCorrect(const V3 &p0, const V3 &p1, const V3 &p2, FragShaderFn frag, const ScreenRect &clip) {
+	DrawTriangleCorrect<FragShaderFn>(p0, p1, p2, frag, clip);
 }
@@ -1,11 +1,16 @@
 #ifndef FRAME_BUFFER_HPP
 #define FRAME_BUFFER_HPP
 
+#include "color.hpp"
 #include "math/v3.hpp"
 #include "ppcamera.hpp"
+#include "raster_simd.hpp"
 
+#include <algorithm>
 #include <cstdint>
 #include <functional>
+#include <type_traits>
+#include <vector>
 
 struct CubeMap;
 
@@ -18,21 +23,101 @@ struct CubeMap;
 using FragShaderResult = V3;
 using FragShaderFn = std::function<FragShaderResult(const V3 &, float, int, int)>;
 
+// inclusive pixel bounds, used to limit drawing to part of a buffer
+struct ScreenRect {
+	int left, top, right, bottom;
+
+	constexpr bool Empty() const {
+		return left > right || top > bottom;
+	}
+
+	constexpr ScreenRect Intersect(const ScreenRect &o) const {
+		return ScreenRect{
+			std::max(left, o.left), std::max(top, o.top),
+			std::min(right, o.right), std::min(bottom, o.bottom)
+		};
+	}
+};
+
+// pass as visit to FrameBuffer::RasterizeTriangle to only write z.
+// the rasterizer then skips everything it does for visiting pixels
+struct DepthOnlyVisit {
+	inline void operator()(int, const V3 &, float, int, int) const {}
+};
+
 struct FrameBuffer {
 
+	// how pixels are ordered in cb and zb. linear is row major. tiled keeps every
+	// LAYOUT_TILE x LAYOUT_TILE block of pixels together (rows of tiles, rows inside a tile),
+	// so drawing a small triangle touches a few cache lines instead of one per row.
+	// always go through Index, and use LinearColors to get a row major copy of cb
+	enum Layout: int {
+		LAYOUT_LINEAR = 0,
+		LAYOUT_TILED = 1,
+	};
+	static constexpr int LAYOUT_TILE = 8;
+	static_assert(LAYOUT_TILE == 8, "Index uses shifts for the tile size");
+
 	int w, h;
+	Layout layout;
+	// tiles per row, the buffers are padded to whole tiles
+	int tilesX, tilesY;
 
-	// color buffer pointer
+	// color buffer pointer, 64 byte aligned. nullptr for depth only buffers
 	uint32_t *cb;
-	// z buffer pointer
+	// only has a z buffer, see DepthBuffer
+	bool depthOnly;
+	// z buffer pointer, 64 byte aligned
 	float *zb;
+	// note: Clear is lazy, call ResolveClear before touching cb or zb directly
 
-	FrameBuffer(unsigned width, unsigned height);
+	// hierarchical z buffer. for each HIZ_TILE x HIZ_TILE block of pixels, the smallest
+	// (farthest) z in that block of zb. a triangle whose nearest z isn't larger than
+	// that can't pass the depth test anywhere in the block, so the block is skipped.
+	// writes to zb only mark the block dirty, it gets recomputed when it is next needed
+	static constexpr int HIZ_TILE = 8;
+	int hizW, hizH;
+	float *hizFar;
+	uint8_t *hizDirty;
+
+	// lazy clearing. Clear only records the color and moves clearGeneration on. each block of
+	// pixels (the hierarchical z blocks) gets filled in the first time it's drawn to or shown,
+	// so parts of the screen nothing covers only cost a write at present time.
+	// a block whose tileGeneration is behind clearGeneration is still waiting for its clear
+	uint32_t clearColor;
+	uint32_t clearGeneration;
+	uint32_t *tileGeneration;
+
+	// scratch space for LinearColors
+	mutable std::vector<uint32_t> linearColors;
+
+	FrameBuffer(unsigned width, unsigned height, bool depthOnly = false);
 	FrameBuffer();
 	~FrameBuffer();
 
+	// owns its buffers, so copying would free them twice. see Copy
+	FrameBuffer(const FrameBuffer &) = delete;
+	FrameBuffer &operator=(const FrameBuffer &) = delete;
+
 	void Resize(unsigned width, unsigned height);
 
+	// where pixel u, v is in cb and zb
+	inline int Index(int u, int v) const {
+		return Index(layout, u, v);
+	}
+	// where pixel u, v would be in another layout
+	inline int Index(Layout pixelLayout, int u, int v) const {
+		if (pixelLayout == LAYOUT_LINEAR) return u + v * w;
+		return (((v >> 3) * tilesX + (u >> 3)) << 6) + ((v & 7) << 3) + (u & 7);
+	}
+	// number of elements in cb and zb, including padding
+	size_t BufferSize(void) const;
+	// rearrange the pixels into another layout, keeping the image
+	void SetLayout(Layout newLayout);
+	// the color buffer in row major order, for showing or saving it.
+	// only copies in the tiled layout, the pointer is valid until the next call
+	const uint32_t *LinearColors(void) const;
+
 	// TIFF file IO
 	// copied and modified from framebuffer.cpp example code
 	bool SaveToTiff(const char *path) const;
@@ -40,14 +125,19 @@ struct FrameBuffer {
 
 	// basic drawing functionality
 	void SetPixel(int u, int v, uint32_t color);
+	// set every pixel to color and every z to 0, lazily
 	void Clear(uint32_t color);
-	void Clear(CubeMap &map, const PPCamera &camera);
+	// set every z in rect back to 0, leaving the colors alone
+	void ClearZ(const ScreenRect &rect);
+	// draw the cube map as a background, clearing z. with depthPrepass, zb must hold a depth only
+	// draw (see Mesh::DrawDepthOnly) of what comes next, and the pixels it covers are left alone
+	void Clear(CubeMap &map, const PPCamera &camera, bool depthPrepass = false);
 	float GetZ(int u, int v) const;
 
 	V3 GetColorI(int x, int y) const;
-	V3 GetColor(float x, float y, bool repeat = false, bool bilinear = false);
+	V3 GetColor(float x, float y, bool repeat = false, bool bilinear = false) const;
 
-	V3 GetColorBilinear(float x, float y);
+	V3 GetColorBilinear(float x, float y) const;
 
 	// more advanced drawing
 	void DrawRect(int u, int v, unsigned width, unsigned height, uint32_t color);
@@ -80,9 +170,203 @@ struct FrameBuffer {
 	void DrawCamera(const PPCamera &camera, const PPCamera &drawnCamera);
 	void DrawTriangle(const PPCamera &camera, const V3 &p0, const V3 &p1, const V3 &p2, const V3 &c0, const V3 &c1, const V3 &c2);
 
+	// true if the block of pixels containing u, v hasn't been filled in since the last Clear
+	inline bool ClearPending(int u, int v) const {
+		return tileGeneration[u / HIZ_TILE + (v / HIZ_TILE) * hizW] != clearGeneration;
+	}
+	// fill in one block waiting for a clear
+	void ResolveTile(int tileX, int tileY) const;
+	// fill in every block waiting for a clear. the pixels don't change as far as
+	// GetZ and GetColorI can tell, so this is const
+	void ResolveClear(void) const;
+
+	// the farthest z in a hierarchical z block, recomputing it if it's dirty
+	float HiZFarthest(int tileX, int tileY);
+	// call after writing zb at u, v outside of SetPixel and the rasterizers
+	void HiZMarkDirty(int u, int v);
+	// mark every block dirty, for when all of zb changed
+	void HiZInvalidate(void);
+
+	// the whole buffer as a ScreenRect
+	ScreenRect Bounds(void) const;
+	// pixels the triangle rasterizers visit for a projected triangle, clipped to this buffer
+	ScreenRect TriangleBounds(const V3 &p0, const V3 &p1, const V3 &p2) const;
+
+	// rasterize a projected triangle inside clip. for every pixel that passes the depth test,
+	// its z is written and then visit(bufferIndex, B, z, u, v) is called.
+	// coverage and depth are tested 8 or 4 pixels at a time when the cpu can, see GetSimdLevel.
+	// coverage follows the top-left rule, so triangles sharing an edge never both draw a pixel on it
+	template <typename Visit>
+	void RasterizeTriangle(const V3 &p0, const V3 &p1, const V3 &p2, const ScreenRect &clip, const Visit &visit);
+
+	// frag is any functor with the FragShaderFn signature. its type is a template parameter,
+	// so each shader gets its own inner loop with the shader inlined into it.
+	// the clip versions only touch pixels inside clip, but shade them exactly
+	// like the full versions do, so a triangle can be drawn in pieces
+	template <typename Frag>
+	void DrawTriangle(const V3 &p0, const V3 &p1, const V3 &p2, const Frag &frag, const ScreenRect &clip);
+	template <typename Frag>
+	void DrawTriangleCorrect(const V3 &p0, const V3 &p1, const V3 &p2, const Frag &frag, const ScreenRect &clip);
+
+	// slower versions for ad-hoc shaders, every pixel goes through std::function
 	void DrawTriangle(const V3 &p0, const V3 &p1, const V3 &p2, FragShaderFn frag);
+	void DrawTriangle(const V3 &p0, const V3 &p1, const V3 &p2, FragShaderFn frag, const ScreenRect &clip);
 	void DrawTriangleCorrect(const V3 &p0, const V3 &p1, const V3 &p2, FragShaderFn frag);
+	void DrawTriangleCorrect(const V3 &p0, const V3 &p1, const V3 &p2, FragShaderFn frag, const ScreenRect &clip);
+
+};
 
+// a frame buffer without a color buffer, for shadow maps. cb is nullptr, so only draw
+// depth into it (Mesh::DrawDepthOnly) and read it back with GetZ, or show it with DrawZBuffer
+struct DepthBuffer: FrameBuffer {
+	DepthBuffer(unsigned width, unsigned height): FrameBuffer(width, height, true) {}
+	DepthBuffer(): DepthBuffer(1, 1) {}
 };
 
+// templates have to live in the header
+
+template <typename Visit>
+void FrameBuffer::RasterizeTriangle(const V3 &p0, const V3 &p1, const V3 &p2, const ScreenRect &clip, const Visit &visit) {
+	const ScreenRect bounds = TriangleBounds(p0, p1, p2).Intersect(clip);
+	if (bounds.Empty()) return;
+
+	// 28.4 fixed point vertices, see raster_simd.hpp
+	const double x0 = SnapToSubpixel(p0.x()), y0 = SnapToSubpixel(p0.y());
+	const double x1 = SnapToSubpixel(p1.x()), y1 = SnapToSubpixel(p1.y());
+	const double x2 = SnapToSubpixel(p2.x()), y2 = SnapToSubpixel(p2.y());
+
+	// twice the signed area. zero area triangles cover nothing
+	double area = (x2 - x1) * (y0 - y1) - (y2 - y1) * (x0 - x1);
+	if (area == 0) return;
+	// flip the edges of the other winding so the inside is always positive
+	const double sign = area > 0 ? 1.0 : -1.0;
+	area *= sign;
+
+	// edge function of the edge from a to b at pixel (u, v), which is sampled at
+	// (u * 16, v * 16), as E = A * u + B * v + C. positive on the same side as the opposite vertex
+	struct Edge { double A, B, C, bias; };
+	auto makeEdge = [&](double ax, double ay, double bx, double by) {
+		Edge e;
+		e.A = -(by - ay) * SUBPIXEL_STEPS * sign;
+		e.B = (bx - ax) * SUBPIXEL_STEPS * sign;
+		e.C = ((by - ay) * ax - (bx - ax) * ay) * sign;
+
+		// top-left rule: a top edge is horizontal with the inside below it (y points down),
+		// a left edge has the inside to its right. those own the pixels exactly on them
+		const bool topLeft = e.A > 0 || (e.A == 0 && e.B > 0);
+		e.bias = topLeft ? 0.0 : -1.0;
+		return e;
+	};
+
+	// each vertex's barycentric coordinate comes from the edge across from it
+	const Edge e0 = makeEdge(x1, y1, x2, y2);
+	const Edge e1 = makeEdge(x2, y2, x0, y0);
+	const Edge e2 = makeEdge(x0, y0, x1, y1);
+
+	RasterRow row;
+	row.A0 = e0.A; row.A1 = e1.A; row.A2 = e2.A;
+	row.bias0 = e0.bias; row.bias1 = e1.bias; row.bias2 = e2.bias;
+	row.invArea = 1.0 / area;
+	row.z0 = p0.z(); row.z1 = p1.z(); row.z2 = p2.z();
+
+	constexpr bool visits = !std::is_same_v<Visit, DepthOnlyVisit>;
+
+	// z is interpolated linearly, so no pixel is nearer than the nearest vertex.
+	// the margin covers the rounding in the interpolation
+	const float zNearest = std::max(p0.z(), std::max(p1.z(), p2.z())) * (1.0f + 1e-5f);
+
+#if SIMD_X86
+	const SimdLevel simd = GetSimdLevel();
+
+	// shade the pixels of a SIMD block that passed the test. B is recomputed
+	// the same way the scalar loop below does it
+	auto visitMask = [&](int mask, int x, int y) {
+		for (int currPixX = x; mask != 0; currPixX++, mask >>= 1) {
+			if ((mask & 1) == 0) continue;
+
+			V3 B;
+			RasterPixel(row, currPixX, B[0], B[1], B[2]);
+
+			int bufferIndex = Index(currPixX, y);
+			visit(bufferIndex, B, zb[bufferIndex], currPixX, y);
+		}
+	};
+#endif
+
+	V3 B;
+
+	// walk the triangle one hierarchical z block at a time
+	for (int tileY = bounds.top / HIZ_TILE; tileY <= bounds.bottom / HIZ_TILE; tileY++) {
+		const int top = std::max(bounds.top, tileY * HIZ_TILE);
+		const int bottom = std::min(bounds.bottom, tileY * HIZ_TILE + HIZ_TILE - 1);
+
+		for (int tileX = bounds.left / HIZ_TILE; tileX <= bounds.right / HIZ_TILE; tileX++) {
+			// everything here is already nearer than this triangle
+			if (zNearest <= HiZFarthest(tileX, tileY)) continue;
+
+			if (tileGeneration[tileX + tileY * hizW] != clearGeneration) ResolveTile(tileX, tileY);
+
+			const int left = std::max(bounds.left, tileX * HIZ_TILE);
+			const int right = std::min(bounds.right, tileX * HIZ_TILE + HIZ_TILE - 1);
+			bool wrote = false;
+
+			for (int currPixY = top; currPixY <= bottom; currPixY++) {
+				row.E0 = e0.B * currPixY + e0.C;
+				row.E1 = e1.B * currPixY + e1.C;
+				row.E2 = e2.B * currPixY + e2.C;
+
+				int currPixX = left;
+
+#if SIMD_X86
+				// spans stay inside one block, which is contiguous in either layout
+				if (simd >= SIMD_AVX2) {
+					for (; currPixX + 7 <= right; currPixX += 8) {
+						const int mask = RasterTest8(row, currPixX, &zb[Index(currPixX, currPixY)]);
+						if (visits && mask) visitMask(mask, currPixX, currPixY);
+						wrote |= mask != 0;
+					}
+				}
+
+				if (simd >= SIMD_SSE) {
+					for (; currPixX + 3 <= right; currPixX += 4) {
+						const int mask = RasterTest4(row, currPixX, &zb[Index(currPixX, currPixY)]);
+						if (visits && mask) visitMask(mask, currPixX, currPixY);
+						wrote |= mask != 0;
+					}
+				}
+#endif
+
+				// whatever is left over, or everything without SIMD
+				for (; currPixX <= right; currPixX++) {
+					if (!RasterPixel(row, currPixX, B[0], B[1], B[2])) continue;
+
+					float z = RasterZ(row, B[0], B[1], B[2]);
+					int bufferIndex = Index(currPixX, currPixY);
+
+					if (z > zb[bufferIndex]) {
+						zb[bufferIndex] = z;
+						wrote = true;
+						if (visits) visit(bufferIndex, B, z, currPixX, currPixY);
+					}
+				}
+			}
+
+			if (wrote) hizDirty[tileX + tileY * hizW] = 1;
+		}
+	}
+}
+
+template <typename Frag>
+void FrameBuffer::DrawTriangle(const V3 &p0, const V3 &p1, const V3 &p2, const Frag &frag, const ScreenRect &clip) {
+	RasterizeTriangle(p0, p1, p2, clip, [&](int bufferIndex, const V3 &B, float z, int u, int v) {
+		cb[bufferIndex] = ColorFromV3(frag(B, z, u, v));
+	});
+}
+
+// the rasterization is the same as DrawTriangle, the perspective correction happens in the shader
+template <typename Frag>
+void FrameBuffer::DrawTriangleCorrect(const V3 &p0, const V3 &p1, const V3 &p2, const Frag &frag, const ScreenRect &clip) {
+	DrawTriangle(p0, p1, p2, frag, clip);
+}
+
 #endif
@@ -0,0 +1,44 @@
+#include "g_buffer.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+GBuffer::GBuffer(): w(0), h(0), size(0), triangleIds(nullptr), meshIds(nullptr), barycentrics(nullptr) {
+
+}
+
+GBuffer::~GBuffer() {
+	delete[] triangleIds;
+	delete[] meshIds;
+	delete[] barycentrics;
+}
+
+void GBuffer::Reset(const FrameBuffer &fb) {
+	if (fb.w != w || fb.h != h) {
+		delete[] triangleIds;
+		delete[] meshIds;
+		delete[] barycentrics;
+
+		w = fb.w;
+		h = fb.h;
+
+		// indexed the same as fb's buffers, whatever its layout
+		size = fb.BufferSize();
+		triangleIds = new uint32_t [size];
+		meshIds = new uint16_t [size];
+		barycentrics = new V3 [size];
+	}
+
+	// the ids are all that need clearing, the rest is only read where there is a triangle
+	std::fill(triangleIds, triangleIds + size, NO_TRIANGLE);
+	meshes.clear();
+	models.clear();
+}
+
+uint16_t GBuffer::AddMesh(const Mesh *mesh, const Transform &model) {
+	assert(meshes.size() < UINT16_MAX && "too many meshes in one g buffer");
+
+	meshes.push_back(mesh);
+	models.push_back(model);
+	return (uint16_t) (meshes.size() - 1);
+}
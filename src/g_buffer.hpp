@@ -0,0 +1,46 @@
+#ifndef G_BUFFER_HPP
+#define G_BUFFER_HPP
+
+#include "frame_buffer.hpp"
+#include "math/transform.hpp"
+#include "math/v3.hpp"
+
+#include <cstdint>
+#include <vector>
+
+struct Mesh;
+
+// what is visible at each pixel, for deferred shading. the depth lives in the
+// frame buffer's z buffer, this holds which triangle won the depth test and where on it
+struct GBuffer {
+	static constexpr uint32_t NO_TRIANGLE = UINT32_MAX;
+
+	int w, h;
+	// elements in each array, indexed by FrameBuffer::Index
+	size_t size;
+
+	// triangle index per pixel, NO_TRIANGLE where nothing was drawn
+	uint32_t *triangleIds;
+	// index into meshes per pixel
+	uint16_t *meshIds;
+	// screen space barycentric coordinates per pixel, as the rasterizer computed them
+	V3 *barycentrics;
+
+	// every mesh drawn since the last Reset, and where it was placed
+	std::vector<const Mesh *> meshes;
+	std::vector<Transform> models;
+
+	GBuffer();
+	~GBuffer();
+
+	GBuffer(const GBuffer &) = delete;
+	GBuffer &operator=(const GBuffer &) = delete;
+
+	// match fb's size and forget everything drawn
+	void Reset(const FrameBuffer &fb);
+
+	// remember a mesh, returning the id its pixels are written with
+	uint16_t AddMesh(const Mesh *mesh, const Transform &model = Transform());
+};
+
+#endif // G_BUFFER_HPP
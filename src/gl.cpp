@@ -51,10 +51,31 @@ void hwDrawMesh(const Mesh &mesh, bool fill, HWTexID tex) {
 	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
 }
 
+void hwDrawMesh(const Mesh &mesh, const Transform &model, bool fill, HWTexID tex) {
+	const M3 &L = model.linear;
+	const V3 &T = model.translation;
+
+	// opengl matrices are column major
+	const GLfloat matrix[16] = {
+		L[0][0], L[1][0], L[2][0], 0.0f,
+		L[0][1], L[1][1], L[2][1], 0.0f,
+		L[0][2], L[1][2], L[2][2], 0.0f,
+		T[0], T[1], T[2], 1.0f,
+	};
+
+	glMatrixMode(GL_MODELVIEW);
+	glPushMatrix();
+	glMultMatrixf(matrix);
+
+	hwDrawMesh(mesh, fill, tex);
+
+	glPopMatrix();
+}
+
 void hwTexFromFb(HWTexID texId, const FrameBuffer &fb) {
 	if (texId != 0) {
 		glBindTexture(GL_TEXTURE_2D, texId);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, fb.w, fb.h, 0, GL_RGBA, GL_UNSIGNED_BYTE, fb.cb);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, fb.w, fb.h, 0, GL_RGBA, GL_UNSIGNED_BYTE, fb.LinearColors());
 	}
 }
 
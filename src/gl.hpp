@@ -2,6 +2,7 @@
 #define GL_HPP
 
 #include "frame_buffer.hpp"
+#include "math/transform.hpp"
 #include "math/v3.hpp"
 #include "mesh.hpp"
 
@@ -20,6 +21,8 @@ void hwInit(void);
 void hwClear(const V3 &color);
 
 void hwDrawMesh(const Mesh &mesh, bool fill = true, HWTexID tex = 0);
+// draw an instance of mesh placed by model
+void hwDrawMesh(const Mesh &mesh, const Transform &model, bool fill = true, HWTexID tex = 0);
 
 void hwTexFromFb(HWTexID texId, const FrameBuffer &fb);
 
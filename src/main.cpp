@@ -1,4 +1,5 @@
 
+#include "mesh.hpp"
 #include "scenes/hardware_demo.hpp"
 #include "window_group.hpp"
 #include "window.hpp"
@@ -14,7 +15,20 @@
 #include "scenes/texture_demo.hpp"
 #include "scenes/envmapping.hpp"
 
-int main(void) {
+#include <cstring>
+
+int main(int argc, char **argv) {
+	// convert a .bin mesh to the compact format instead of opening a window:
+	//   graphics-pipeline --compact geometry/bunny.bin geometry/bunny.cmesh
+	if (argc == 4 && strcmp(argv[1], "--compact") == 0) {
+		Mesh mesh;
+		mesh.Load(argv[2]);
+		if (mesh.vertexCount == 0) return 1;
+		// saved in drawing order, which also makes the index deltas smaller
+		mesh.OptimizeVertexCache();
+		return mesh.SaveCompact(argv[3]) ? 0 : 1;
+	}
+
 	auto g = WindowGroup(30);
 
 	// primitives: PrimitivesScene
@@ -0,0 +1,94 @@
+#include "mapped_file.hpp"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile():
+	data(nullptr), size(0)
+#ifdef _WIN32
+	, mapping(nullptr)
+#endif
+{}
+
+MappedFile::~MappedFile() {
+	Close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::Open(const char *path) {
+	Close();
+
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) return false;
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+		CloseHandle(file);
+		return false;
+	}
+
+	// the mapping keeps the file open on its own
+	mapping = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+	CloseHandle(file);
+	if (!mapping) return false;
+
+	data = (uint8_t *) MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+	if (!data) {
+		Close();
+		return false;
+	}
+
+	size = (size_t) fileSize.QuadPart;
+	return true;
+}
+
+void MappedFile::Close(void) {
+	if (data) UnmapViewOfFile(data);
+	if (mapping) CloseHandle(mapping);
+
+	data = nullptr;
+	mapping = nullptr;
+	size = 0;
+}
+
+#else
+
+bool MappedFile::Open(const char *path) {
+	Close();
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return false;
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size == 0) {
+		close(fd);
+		return false;
+	}
+
+	// private and writable means copy on write, the file itself is never changed
+	void *mapped = mmap(nullptr, (size_t) info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	// the mapping keeps the file open on its own
+	close(fd);
+	if (mapped == MAP_FAILED) return false;
+
+	data = (uint8_t *) mapped;
+	size = (size_t) info.st_size;
+	return true;
+}
+
+void MappedFile::Close(void) {
+	if (data) munmap(data, size);
+
+	data = nullptr;
+	size = 0;
+}
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+// a whole file mapped into memory. the pages are loaded on first use and shared
+// with every other process mapping the same file. writing to the data is allowed,
+// but only changes this mapping, and only copies the pages that were written to
+struct MappedFile {
+	uint8_t *data;
+	size_t size;
+
+	MappedFile();
+	~MappedFile();
+
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+
+	// map path, closing any previous file. false if it can't be opened or mapped
+	bool Open(const char *path);
+	void Close(void);
+
+private:
+#ifdef _WIN32
+	void *mapping;
+#endif
+};
+
+#endif // MAPPED_FILE_HPP
@@ -38,3 +38,15 @@ M3 M3::RotationZ(float degrees) {
 		0, 0, 1
 	);
 }
+
+M3 M3::RotationAxis(const V3 &axis, float degrees) {
+	// local coordinate system with axis as y, like V3::RotateAroundAxis
+	M3 lcs;
+	lcs[1] = axis;
+	V3 aux = fabsf(axis[0]) < fabsf(axis[1]) ? V3(1, 0, 0) : V3(0, 1, 0);
+	lcs[0] = (aux ^ axis).Normalized();
+	lcs[2] = lcs[0] ^ lcs[1];
+
+	// into the lcs, rotate about y, and back out
+	return lcs.Inverse() * RotationY(degrees) * lcs;
+}
@@ -36,6 +36,9 @@ struct M3 {
 	static M3 RotationX(float degrees);
 	static M3 RotationY(float degrees);
 	static M3 RotationZ(float degrees);
+	// rotation around any direction by degrees, the same as V3::RotateAroundDirection
+	// but built once so it can be applied to many vectors
+	static M3 RotationAxis(const V3 &axis, float degrees);
 
 	// read-only access to rows
 	constexpr const V3 &operator[](int index) const { return rows[index]; }
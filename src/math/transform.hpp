@@ -0,0 +1,42 @@
+#ifndef MATH_TRANSFORM_HPP
+#define MATH_TRANSFORM_HPP
+
+#include "math/m3.hpp"
+#include "math/v3.hpp"
+
+// an affine transform, P' = linear * P + translation
+struct Transform {
+	M3 linear;
+	V3 translation;
+
+	// identity transform
+	Transform(): linear(M3::Identity()), translation() {}
+	Transform(const M3 &linear, const V3 &translation): linear(linear), translation(translation) {}
+
+	static inline Transform Translation(const V3 &delta) {
+		return Transform(M3::Identity(), delta);
+	}
+
+	// rotate by degrees around the line through origin along axis
+	static inline Transform Rotation(const V3 &origin, const V3 &axis, float degrees) {
+		const M3 rotation = M3::RotationAxis(axis, degrees);
+		// R * (P - O) + O
+		return Transform(rotation, origin - rotation * origin);
+	}
+
+	inline V3 ApplyPoint(const V3 &P) const {
+		return linear * P + translation;
+	}
+
+	// directions, like normals, ignore the translation
+	inline V3 ApplyDirection(const V3 &d) const {
+		return linear * d;
+	}
+
+	// o first, then this
+	inline Transform operator*(const Transform &o) const {
+		return Transform(linear * o.linear, linear * o.translation + translation);
+	}
+};
+
+#endif
@@ -1,16 +1,32 @@
 #include "mesh.hpp"
 #include "aabb.hpp"
+#include "clipper.hpp"
 #include "color.hpp"
+#include "compact_mesh.hpp"
 #include "cube_map.hpp"
+#include "cube_shadow_map.hpp"
 #include "frame_buffer.hpp"
+#include "g_buffer.hpp"
+#include "mapped_file.hpp"
 #include "math/v3.hpp"
 #include "ppcamera.hpp"
+#include "shadow_sampler.hpp"
+#include "texture.hpp"
+#include "thread_pool.hpp"
+#include "tile_binner.hpp"
+#include "vertex_cache.hpp"
 
 #include <cassert>
 #include <cmath>
 #include <iostream>
-#include <fstream>
+#include <vector>
+#include <algorithm>
 #include <cfloat>
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <type_traits>
 
 Mesh::Mesh() {
 	vertices = nullptr;
@@ -21,6 +37,10 @@ Mesh::Mesh() {
 	triangles = nullptr;
 	triangleCount = 0;
 	tcs = nullptr;
+	cullBackFaces = false;
+	cullStats = CullStats{};
+	drawModel = nullptr;
+	version = 0;
 }
 
 Mesh::~Mesh() {
@@ -31,75 +51,121 @@ V3 Mesh::GetCenter(void) const {
 	return centerOfMass;
 }
 
+// how far from 1 a normal's square length can be before it gets renormalized,
+// a few float roundings of an already normalized vector
+static constexpr float NORMAL_LENGTH_TOLERANCE = 1e-5f;
+
 void Mesh::UpdateCenterOfMass(void) {
 	centerOfMass = V3();
 	for (size_t i = 0; i < vertexCount; i++)
 		centerOfMass += vertices[i];
 	centerOfMass /= (float) vertexCount;
 
-	// also renormalize the vertices
+	// also renormalize the vertices. normals already about unit length are left alone,
+	// so a mapped file's normal pages are only copied if some actually need it
 	if (normals) for (size_t i = 0; i < vertexCount; i++) {
-		normals[i] = normals[i].Normalized();
+		const float squareLength = normals[i].SquareLength();
+		if (std::fabs(squareLength - 1.0f) > NORMAL_LENGTH_TOLERANCE) normals[i] = normals[i].Normalized();
 	}
 }
 
 void Mesh::Translate(const V3 &delta) {
+	// not moving isn't a change
+	if (delta.x() == 0.0f && delta.y() == 0.0f && delta.z() == 0.0f) return;
+
 	for (size_t vi = 0; vi < vertexCount; vi++) {
 		vertices[vi] += delta;
 	}
 	centerOfMass += delta;
+	MarkChanged();
 }
 
 void Mesh::TranslateTo(const V3 &position) {
 	Translate(position - centerOfMass);
+	// exactly, so moving to the same place again is no change
+	centerOfMass = position;
 }
 
 void Mesh::Scale(const float &scale) {
 	for (size_t i = 0; i < vertexCount; i++)
 		vertices[i] = (vertices[i] - centerOfMass) * scale + centerOfMass;
 	// no need to update center of mass
+	MarkChanged();
 }
 
 void Mesh::Reset(void) {
-	delete []vertices;
+	// loaded meshes point into their file instead of owning their arrays
+	if (!mappedFile) {
+		delete []vertices;
+		delete []colors;
+		delete []normals;
+		delete []triangles;
+		delete []tcs;
+	}
+	mappedFile.reset();
+
 	vertices = nullptr;
 	delete []projectedVertices;
 	projectedVertices = nullptr;
 	vertexCount = 0;
-	delete []colors;
 	colors = nullptr;
-	delete []normals;
 	normals = nullptr;
-	delete []triangles;
 	triangles = nullptr;
 	triangleCount = 0;
-	delete []tcs;
 	tcs = nullptr;
+	MarkChanged();
 }
 
-void Mesh::RotateAroundAxis(const V3 &origin, const V3 &axis, float theta) {
+// meshes with at least this many vertices are transformed and projected on the thread pool,
+// split into jobs of TRANSFORM_BATCH vertices
+static constexpr size_t PARALLEL_TRANSFORM_VERTICES = 16384;
+static constexpr size_t TRANSFORM_BATCH = 4096;
 
-	for (size_t vi = 0; vi < vertexCount; vi++) {
-		vertices[vi] = vertices[vi].RotateAroundAxis(origin, axis, theta);
-	}
+void Mesh::ApplyTransform(const Transform &transform) {
+	// local copies, so the loops don't reload them through the reference every vertex
+	const M3 M = transform.linear;
+	const V3 T = transform.translation;
 
-	if (normals) {
-		for (size_t vi = 0; vi < vertexCount; vi++) {
-			normals[vi] = normals[vi].RotateAroundDirection(axis, theta);
+	auto apply = [&](size_t first, size_t last) {
+		for (size_t vi = first; vi < last; vi++) {
+			vertices[vi] = M * vertices[vi] + T;
 		}
+
+		if (normals) {
+			for (size_t vi = first; vi < last; vi++) {
+				normals[vi] = M * normals[vi];
+			}
+		}
+	};
+
+	if (vertexCount >= PARALLEL_TRANSFORM_VERTICES) {
+		const size_t batches = (vertexCount + TRANSFORM_BATCH - 1) / TRANSFORM_BATCH;
+		ThreadPool::Global().ParallelFor(batches, [&](size_t batch) {
+			apply(batch * TRANSFORM_BATCH, std::min(vertexCount, (batch + 1) * TRANSFORM_BATCH));
+		});
+	} else {
+		apply(0, vertexCount);
 	}
 
-	centerOfMass = centerOfMass.RotateAroundAxis(origin, axis, theta);
+	centerOfMass = transform.ApplyPoint(centerOfMass);
+	MarkChanged();
+}
 
+void Mesh::RotateAroundAxis(const V3 &origin, const V3 &axis, float theta) {
+	// build the rotation once instead of per vertex
+	ApplyTransform(Transform::Rotation(origin, axis, theta));
 }
 
 void Mesh::RotateAroundDirection(const V3 &axis, float theta) {
 	RotateAroundAxis(centerOfMass, axis, theta);
 }
 
+// the file's arrays are used as V3s directly
+static_assert(sizeof(V3) == 3 * sizeof(float), "V3 must be packed floats");
+
 void Mesh::Load(const std::string &path) {
-	std::ifstream ifs(path, std::ios::binary);
-	if (ifs.fail()) {
+	auto file = std::make_unique<MappedFile>();
+	if (!file->Open(path.c_str())) {
 		std::cerr << "INFO: cannot open file: " << path << std::endl;
 		return;
 	}
@@ -107,56 +173,185 @@ void Mesh::Load(const std::string &path) {
 	// clear the model and deallocate its data
 	Reset();
 
-	ifs.read((char*)&vertexCount, sizeof(int));
-	char yn;
-	ifs.read(&yn, 1); // always xyz
-	if (yn != 'y') {
-		std::cerr << "INTERNAL ERROR: there should always be vertex xyz data" << std::endl;
+	// compact meshes are decoded into arrays of their own, and the file is let go
+	if (IsCompactMesh(file->data, file->size)) {
+		LoadCompact(*file, path);
 		return;
 	}
 
-	vertices = new V3[vertexCount];
-
-	ifs.read(&yn, 1); // cols 3 floats
-	if (yn == 'y') {
-		colors = new V3[vertexCount];
+	// the arrays are used right where they sit in the file, nothing is copied.
+	// pages are only read in when used, and only copied if the mesh is changed
+	mappedFile = std::move(file);
+
+	// hands out the next count elements of the file, or nullptr if it's too short
+	size_t offset = 0;
+	auto take = [&](size_t count, size_t elementSize) -> uint8_t * {
+		if (count > (mappedFile->size - offset) / elementSize) return nullptr;
+		uint8_t *p = mappedFile->data + offset;
+		offset += count * elementSize;
+		return p;
+	};
+
+	auto fail = [&](const char *why) {
+		std::cerr << "ERROR: bad mesh file " << path << ": " << why << std::endl;
+		Reset();
+	};
+
+	// vertex count, then y/n for xyz, rgb, normals and texture coordinates
+	const uint8_t *header = take(1, sizeof(int32_t) + 4);
+	if (!header) return fail("missing header");
+
+	int32_t fileVertexCount;
+	memcpy(&fileVertexCount, header, sizeof(fileVertexCount));
+	const char *has = (const char *) header + sizeof(fileVertexCount);
+
+	if (fileVertexCount < 0) return fail("negative vertex count");
+	for (int i = 0; i < 4; i++) {
+		if (has[i] != 'y' && has[i] != 'n') return fail("bad attribute flags");
 	}
+	if (has[0] != 'y') return fail("there should always be vertex xyz data");
 
-	ifs.read(&yn, 1); // normals 3 floats
-	if (yn == 'y') {
-		normals = new V3[vertexCount];
-	}
+	vertexCount = (size_t) fileVertexCount;
 
-	ifs.read(&yn, 1); // texture coordinates 2 floats
-	if (yn == 'y') {
-		tcs = new float[vertexCount * 2];
-	}
+	vertices = (V3 *) take(vertexCount, sizeof(V3));
+	if (!vertices) return fail("file ends in the vertices");
+
+	if (has[1] == 'y' && !(colors = (V3 *) take(vertexCount, sizeof(V3))))
+		return fail("file ends in the colors");
+
+	if (has[2] == 'y' && !(normals = (V3 *) take(vertexCount, sizeof(V3))))
+		return fail("file ends in the normals");
+
+	if (has[3] == 'y' && !(tcs = (float *) take(vertexCount, 2 * sizeof(float))))
+		return fail("file ends in the texture coordinates");
+
+	const uint8_t *triangleHeader = take(1, sizeof(int32_t));
+	if (!triangleHeader) return fail("missing triangle count");
+
+	int32_t fileTriangleCount;
+	memcpy(&fileTriangleCount, triangleHeader, sizeof(fileTriangleCount));
+	if (fileTriangleCount < 0) return fail("negative triangle count");
 
+	triangleCount = (size_t) fileTriangleCount;
 
-	ifs.read((char*)vertices, vertexCount * 3 * sizeof(float)); // load verts
+	triangles = (unsigned int *) take(triangleCount, 3 * sizeof(unsigned int));
+	if (!triangles) return fail("file ends in the triangles");
 
-	if (colors) {
-		ifs.read((char*)colors, vertexCount * 3 * sizeof(float)); // load colors
+	// the rasterizer trusts these, so a bad one would read outside the vertices
+	for (size_t i = 0; i < triangleCount * 3; i++) {
+		if (triangles[i] >= vertexCount) return fail("triangle uses a vertex that doesn't exist");
 	}
 
-	if (normals)
-		ifs.read((char*)normals, vertexCount * 3 * sizeof(float)); // load normals
+	std::cerr << "INFO: loaded " << vertexCount << " verts, " << triangleCount << " tris from " << std::endl << "      " << path << std::endl;
+	std::cerr << "      xyz " << ((colors) ? "rgb " : "") << ((normals) ? "nxnynz " : "") << ((tcs) ? "tcstct " : "") << std::endl;
+
+	UpdateCenterOfMass();
+}
+
+// decode compact meshes this big on the thread pool, TRANSFORM_BATCH vertices per job
+static constexpr size_t PARALLEL_DECODE_VERTICES = 16384;
+
+void Mesh::LoadCompact(const MappedFile &file, const std::string &path) {
+	CompactMeshDecoder decoder;
+	if (!decoder.Open(file.data, file.size)) {
+		std::cerr << "ERROR: bad mesh file " << path << ": compact mesh is cut short, has the wrong version or too few indices" << std::endl;
+		return;
+	}
 
-	if (tcs)
-		ifs.read((char*)tcs, vertexCount * 2 * sizeof(float)); // load texture coordinates
+	vertexCount = decoder.VertexCount();
+	triangleCount = decoder.TriangleCount();
 
-	ifs.read((char*)&triangleCount, sizeof(int));
+	vertices = new V3[vertexCount];
+	if (decoder.HasColors()) colors = new V3[vertexCount];
+	if (decoder.HasNormals()) normals = new V3[vertexCount];
+	if (decoder.HasTcs()) tcs = new float[vertexCount * 2];
 	triangles = new unsigned int[triangleCount * 3];
-	ifs.read((char*)triangles, triangleCount * 3 * sizeof(unsigned int)); // read tiangles
 
-	ifs.close();
+	// each piece goes straight from the file into the arrays that get drawn
+	auto decode = [&](size_t first, size_t last) {
+		decoder.DecodePositions(first, last - first, vertices + first);
+		if (colors) decoder.DecodeColors(first, last - first, colors + first);
+		if (normals) decoder.DecodeNormals(first, last - first, normals + first);
+		if (tcs) decoder.DecodeTcs(first, last - first, tcs + 2 * first);
+	};
+
+	if (vertexCount >= PARALLEL_DECODE_VERTICES) {
+		const size_t batches = (vertexCount + TRANSFORM_BATCH - 1) / TRANSFORM_BATCH;
+		ThreadPool::Global().ParallelFor(batches, [&](size_t batch) {
+			decode(batch * TRANSFORM_BATCH, std::min(vertexCount, (batch + 1) * TRANSFORM_BATCH));
+		});
+	} else {
+		decode(0, vertexCount);
+	}
+
+	if (!decoder.DecodeTriangles(triangleCount, triangles)) {
+		std::cerr << "ERROR: bad mesh file " << path << ": bad triangle indices" << std::endl;
+		Reset();
+		return;
+	}
 
 	std::cerr << "INFO: loaded " << vertexCount << " verts, " << triangleCount << " tris from " << std::endl << "      " << path << std::endl;
-	std::cerr << "      xyz " << ((colors) ? "rgb " : "") << ((normals) ? "nxnynz " : "") << ((tcs) ? "tcstct " : "") << std::endl;
+	std::cerr << "      compact xyz " << ((colors) ? "rgb " : "") << ((normals) ? "nxnynz " : "") << ((tcs) ? "tcstct " : "") << std::endl;
 
 	UpdateCenterOfMass();
 }
 
+bool Mesh::SaveCompact(const std::string &path) const {
+	std::vector<uint8_t> data;
+	EncodeCompactMesh(data, vertices, colors, normals, tcs, vertexCount, triangles, triangleCount);
+
+	std::ofstream file(path, std::ios::binary);
+	if (!file) {
+		std::cerr << "INFO: cannot open file: " << path << std::endl;
+		return false;
+	}
+
+	file.write((const char *) data.data(), (std::streamsize) data.size());
+	return (bool) file;
+}
+
+// move element i of data (stride values each) to newIndex[i]
+template <typename T>
+static void Permute(T *data, const std::vector<unsigned int> &newIndex, size_t stride) {
+	std::vector<T> old(data, data + newIndex.size() * stride);
+	for (size_t i = 0; i < newIndex.size(); i++) {
+		for (size_t k = 0; k < stride; k++) data[newIndex[i] * stride + k] = old[i * stride + k];
+	}
+}
+
+void Mesh::OptimizeVertexCache(void) {
+	const float before = AverageCacheMissRatio(triangles, triangleCount, vertexCount);
+
+	OptimizeTriangleOrder(triangles, triangleCount, vertexCount);
+
+	// renumber the vertices in the order the triangles first use them,
+	// so drawing walks forward through the vertex arrays
+	std::vector<unsigned int> newIndex(vertexCount, UINT_MAX);
+	unsigned int next = 0;
+	for (size_t i = 0; i < triangleCount * 3; i++) {
+		unsigned int &v = newIndex[triangles[i]];
+		if (v == UINT_MAX) v = next++;
+		triangles[i] = v;
+	}
+	// unused vertices go at the end
+	for (unsigned int &v : newIndex) {
+		if (v == UINT_MAX) v = next++;
+	}
+
+	if (vertices) Permute(vertices, newIndex, 1);
+	if (colors) Permute(colors, newIndex, 1);
+	if (normals) Permute(normals, newIndex, 1);
+	if (tcs) Permute(tcs, newIndex, 2);
+
+	// numbered the old way
+	delete []projectedVertices;
+	projectedVertices = nullptr;
+	MarkChanged();
+
+	const float after = AverageCacheMissRatio(triangles, triangleCount, vertexCount);
+	std::cerr << "INFO: vertex cache miss ratio " << before << " -> " << after << " (" << VERTEX_CACHE_SIZE << " entries)" << std::endl;
+}
+
 void Mesh::LoadRectangle(const V3 &center, const V3 &dimensions, const V3 &color) {
 
 	V3 halfs = dimensions / 2;
@@ -291,16 +486,41 @@ AABB Mesh::GetAABB(void) const {
 	return AABB(min, max);
 }
 
+// vertices are split into separate x, y and z arrays this many at a time for projecting
+static constexpr size_t PROJECT_CHUNK = 256;
+
 void Mesh::ProjectVertices(const PPCamera &camera) {
-	if (vertices != nullptr && vertexCount > 0 && projectedVertices == nullptr) {
-		projectedVertices = new V3[vertexCount];
-	}
-	if (projectedVertices && vertices && vertexCount > 0) {
-		for (size_t i = 0; i < vertexCount; i++) {
-			if (!camera.ProjectPoint(vertices[i], projectedVertices[i])) {
-				projectedVertices[i].z() = -1.0f;
+	if (vertices == nullptr || vertexCount == 0) return;
+	if (projectedVertices == nullptr) projectedVertices = new V3[vertexCount];
+
+	ProjectVertices(camera, projectedVertices);
+}
+
+void Mesh::ProjectVertices(const PPCamera &camera, V3 *projected) const {
+	if (vertices == nullptr || vertexCount == 0) return;
+
+	auto project = [&](size_t first, size_t last) {
+		float xs[PROJECT_CHUNK], ys[PROJECT_CHUNK], zs[PROJECT_CHUNK];
+
+		for (size_t start = first; start < last; start += PROJECT_CHUNK) {
+			const size_t count = std::min(PROJECT_CHUNK, last - start);
+			for (size_t k = 0; k < count; k++) {
+				xs[k] = vertices[start + k].x();
+				ys[k] = vertices[start + k].y();
+				zs[k] = vertices[start + k].z();
 			}
+
+			camera.ProjectPoints(xs, ys, zs, count, projected + start, drawModel);
 		}
+	};
+
+	if (vertexCount >= PARALLEL_TRANSFORM_VERTICES) {
+		const size_t batches = (vertexCount + TRANSFORM_BATCH - 1) / TRANSFORM_BATCH;
+		ThreadPool::Global().ParallelFor(batches, [&](size_t batch) {
+			project(batch * TRANSFORM_BATCH, std::min(vertexCount, (batch + 1) * TRANSFORM_BATCH));
+		});
+	} else {
+		project(0, vertexCount);
 	}
 }
 
@@ -308,7 +528,7 @@ constexpr static V3 DEFAULT_COLOR = V3(1.f, 1.f, 1.f);
 
 void Mesh::DrawVertices(FrameBuffer &fb, const PPCamera &camera, size_t pointSize) const {
 	for (size_t i = 0; i < vertexCount; i++) {
-		fb.DrawPoint(camera, vertices[i], pointSize, colors ? colors[i] : DEFAULT_COLOR);
+		fb.DrawPoint(camera, WorldVertex(i), pointSize, colors ? colors[i] : DEFAULT_COLOR);
 	}
 }
 
@@ -317,9 +537,9 @@ void Mesh::DrawWireframe(FrameBuffer &fb, const PPCamera &camera) const {
 		unsigned int *tri = &triangles[i * 3];
 
 		V3 p[3];
-		bool in0 = camera.ProjectPoint(vertices[tri[0]], p[0]);
-		bool in1 = camera.ProjectPoint(vertices[tri[1]], p[1]);
-		bool in2 = camera.ProjectPoint(vertices[tri[2]], p[2]);
+		bool in0 = camera.ProjectPoint(WorldVertex(tri[0]), p[0]);
+		bool in1 = camera.ProjectPoint(WorldVertex(tri[1]), p[1]);
+		bool in2 = camera.ProjectPoint(WorldVertex(tri[2]), p[2]);
 			
 		if (in0 && in1)
 			fb.DrawLine(p[0], p[1], colors ? colors[tri[0]] : DEFAULT_COLOR, colors ? colors[tri[1]] : DEFAULT_COLOR);
@@ -330,266 +550,658 @@ void Mesh::DrawWireframe(FrameBuffer &fb, const PPCamera &camera) const {
 	}
 }
 
-// fragment shader variables
-static V3 Frag_meshCenter;
-static V3 Frag_p0, Frag_p1, Frag_p2;
-static V3 Frag_c0, Frag_c1, Frag_c2;
-static V3 Frag_n0, Frag_n1, Frag_n2;
-static PPCamera Frag_camera{1, 1, 1};
-static PPCamera Frag_lightCamera{1, 1, 1};
-static FrameBuffer Frag_lightBuffer{1, 1};
-static FrameBuffer Frag_texBuffer{1, 1};
-static int Frag_filterMode = 0;
-static int Frag_tileMode = 0;
-static float Frag_ka, Frag_specularIntensity, Frag_epsilon;
-static CubeMap Frag_cubeMap;
+// everything a draw's shaders share besides their per triangle values, filled in once
+// per draw and handed to every shader. the buffers are only viewed, the caller owns
+// them and has to keep them alive until the draw returns
+struct FragUniforms {
+	const PPCamera *camera = nullptr;
+	V3 lightPos;
+	const PPCamera *lightCamera = nullptr;
+	const ShadowSampler *shadow = nullptr;
+	const CubeShadowMap *cubeShadow = nullptr;
+	const FrameBuffer *texBuffer = nullptr;
+	const Texture *texture = nullptr;
+	const CubeMap *cubeMap = nullptr;
+	int filterMode = 0;
+	int tileMode = 0;
+	float ka = 0.0f, specularIntensity = 0.0f, epsilon = 0.0f;
+
+	// a pixel's world position is C + (a * u + b * v + c) / z, so its light space
+	// q = <u * w, v * w, w> times z is lightFromScreen * <u, v, 1> + lightFromEye * z.
+	// that only depends on the two cameras, see SetShadowMap
+	M3 lightFromScreen;
+	V3 lightFromEye;
+};
+
+// the light and shadow map values of the uniforms
+static void SetShadowMap(FragUniforms &uniforms, const PPCamera &camera, const PPCamera &lightCamera, const ShadowSampler &shadow) {
+	uniforms.lightPos = lightCamera.C;
+	uniforms.lightCamera = &lightCamera;
+	uniforms.shadow = &shadow;
+	uniforms.lightFromScreen = lightCamera.MInv * M3::FromColumns(camera.a, camera.b, camera.c);
+	uniforms.lightFromEye = lightCamera.MInv * (camera.C - lightCamera.C);
+}
 
-static V3 Frag_DEF;
-static V3 Frag_txABC, Frag_tyABC;
-static V3 Frag_nxABC, Frag_nyABC, Frag_nzABC;
+// fragment shaders
+// each one holds the per-triangle values it interpolates and is filled in right before its
+// triangle is drawn. the rasterizer is templated on the shader type, so these inline into it
 
+struct FragNoLight {
+	V3 c0, c1, c2;
 
-static FragShaderResult FragNoLight(const V3 &B, float, int, int) {
-	return Frag_c0 * B.x() + Frag_c1 * B.y() + Frag_c2 * B.z();
-}
+	FragShaderResult operator()(const V3 &B, float, int, int) const {
+		return c0 * B.x() + c1 * B.y() + c2 * B.z();
+	}
+};
+
+struct FragPointLight {
+	const FragUniforms *uniforms;
+	V3 p0, p1, p2;
+	V3 c0, c1, c2;
+	V3 n0, n1, n2;
+
+	FragShaderResult operator()(const V3 &B, float, int, int) const {
+		V3 C = c0 * B.x() + c1 * B.y() + c2 * B.z();
+		const V3 N = (n0 * B.x() + n1 * B.y() + n2 * B.z()).Normalized();
+		const V3 P = p0 * B.x() + p1 * B.y() + p2 * B.z();
+		const V3 L = (uniforms->lightPos - P).Normalized();
+		C = C.Light(N, L, uniforms->ka);
+
+		// specular highlight stuff
+		const float k = std::max(N.Reflect(L) * (uniforms->camera->C - P).Normalized(), 0.0f);
+		constexpr static float CUTOFF = 0.7f;
+		float specularValue = std::powf(k, uniforms->specularIntensity);
+		if (specularValue >= CUTOFF) C = V3(1, 1, 1) * specularValue + C * (1 - specularValue);
+
+		return C;
+	}
+};
+
+struct FragPointLightShadowMap: FragPointLight {
+
+	FragShaderResult operator()(const V3 &B, float z, int u, int v) const {
+		V3 C = FragPointLight::operator()(B, z, u, v);
 
-static FragShaderResult FragPointLight(const V3 &B, float, int, int) {
-	V3 C = Frag_c0 * B.x() + Frag_c1 * B.y() + Frag_c2 * B.z();
-	const V3 N = (Frag_n0 * B.x() + Frag_n1 * B.y() + Frag_n2 * B.z()).Normalized();
-	const V3 P = Frag_p0 * B.x() + Frag_p1 * B.y() + Frag_p2 * B.z();
-	const V3 L = (Frag_lightCamera.C - P).Normalized();
-	C = C.Light(N, L, Frag_ka);
+		// the pixel's light space position times z, from the same pixel center UnprojectPoint uses
+		const V3 qz = uniforms->lightFromScreen * V3(u + 0.5f, v + 0.5f, 1.0f) + uniforms->lightFromEye * z;
+		if (!(qz.z() > PPCamera::NEAR_Z * z))
+			return C * uniforms->ka; // TODO: what if out of view/behind light source?
 
-	// specular highlight stuff
-	const float k = std::max(N.Reflect(L) * (Frag_camera.C - P).Normalized(), 0.0f);
-	constexpr static float CUTOFF = 0.7f;
-	float specularValue = std::powf(k, Frag_specularIntensity);
-	if (specularValue >= CUTOFF) C = V3(1, 1, 1) * specularValue + C * (1 - specularValue);
+		// <u, v, 1/w> in the shadow map, with one divide
+		const float r = 1.0f / qz.z();
+		const V3 shadowMapUV = V3(qz.x() * r, qz.y() * r, z * r);
 
-	return C;
+		const float lit = uniforms->shadow->Lit(shadowMapUV[0], shadowMapUV[1], shadowMapUV[2], uniforms->epsilon);
+		return Shadowed(C, lit);
+	}
+
+	// C lit by the light, dimmed to ambient as far as the light doesn't reach
+	inline V3 Shadowed(const V3 &C, float lit) const {
+		if (lit == 1.0f) {
+			return C;
+		} else if (lit == 0.0f) {
+			return C * uniforms->ka;
+		} else {
+			// partly shadowed, somewhere between the two
+			return C * (uniforms->ka + (1.0f - uniforms->ka) * lit);
+		}
+	}
+};
+
+struct FragPointLightCubeShadow: FragPointLightShadowMap {
+
+	FragShaderResult operator()(const V3 &B, float z, int u, int v) const {
+		const V3 C = FragPointLight::operator()(B, z, u, v);
+
+		// the pixel's world position is C + (a * u + b * v + c) / z, so this is it minus the
+		// light's times z. B is linear on the screen, so it can't give the position exactly
+		const PPCamera &camera = *uniforms->camera;
+		const V3 dz = camera.a * (u + 0.5f) + camera.b * (v + 0.5f) + camera.c + (camera.C - uniforms->lightPos) * z;
+
+		return Shadowed(C, uniforms->cubeShadow->Lit(dz, z, uniforms->epsilon));
+	}
+};
+
+struct FragTextured {
+	const FragUniforms *uniforms;
+	V3 DEF;
+	V3 txABC, tyABC;
+
+	FragShaderResult operator()(const V3 &, float, int u, int v) const {
+		const V3 uv1 = V3(u, v, 1);
+		const float tx = (txABC * uv1) / (DEF * uv1);
+		const float ty = (tyABC * uv1) / (DEF * uv1);
+
+		return uniforms->texBuffer->GetColor(tx, ty, uniforms->tileMode, uniforms->filterMode);
+	}
+};
+
+struct FragTexturedMip {
+	const FragUniforms *uniforms;
+	V3 DEF;
+	V3 txABC, tyABC;
+
+	FragShaderResult operator()(const V3 &, float, int u, int v) const {
+		const V3 uv1 = V3(u, v, 1);
+		const float d = DEF * uv1;
+		const float tx = (txABC * uv1) / d;
+		const float ty = (tyABC * uv1) / d;
+
+		// screen space derivatives of tx and ty, by the quotient rule
+		const float lod = uniforms->texture->Lod(
+			(txABC.x() - tx * DEF.x()) / d, (tyABC.x() - ty * DEF.x()) / d,
+			(txABC.y() - tx * DEF.y()) / d, (tyABC.y() - ty * DEF.y()) / d
+		);
+
+		return uniforms->texture->Sample(tx, ty, lod, uniforms->tileMode, (Texture::Filter) uniforms->filterMode);
+	}
+};
+
+struct FragEnvMap {
+	const FragUniforms *uniforms;
+	V3 DEF;
+	V3 nxABC, nyABC, nzABC;
+
+	FragShaderResult operator()(const V3 &, float z, int u, int v) const {
+		const V3 uv1 = V3(u, v, 1);
+		const V3 N = V3(
+			(nxABC * uv1) / (DEF * uv1),
+			(nyABC * uv1) / (DEF * uv1),
+			(nzABC * uv1) / (DEF * uv1)
+		).Normalized();
+
+		const V3 eyeRay = (uniforms->camera->UnprojectPoint(u, v, z) - uniforms->camera->C).Normalized();
+		// const V3 N = (n0 * B[0] + n1 * B[1] + n2 * B[2]).Normalized();
+		const V3 RR = N.Reflect(eyeRay);
+
+		// float highlightValue = std::powf(std::max(0.0f, eyeRay.Dot(RR.Normalized())), 50.0f);
+		// return V3(1, 1, 1) * highlightValue + uniforms->cubeMap->Lookup(RR) * (1.0f - highlightValue);
+
+		return uniforms->cubeMap->Lookup(RR);
+	}
+};
+
+// binned triangles with this bit set are indices into clippedTriangles instead of the mesh
+constexpr uint32_t CLIPPED_BIT = 0x80000000u;
+
+uint32_t Mesh::SourceTriangle(uint32_t binned) const {
+	return (binned & CLIPPED_BIT) ? clippedTriangles[binned & ~CLIPPED_BIT].triangle : binned;
+}
+
+// a triangle whose bounds miss every pixel of clip, which is inside the buffer
+static bool OffScreen(const FrameBuffer &fb, const ScreenRect &clip, const V3 &p0, const V3 &p1, const V3 &p2) {
+	return fb.TriangleBounds(p0, p1, p2).Intersect(clip).Empty();
 }
 
-static FragShaderResult FragPointLightShadowMap(const V3 &B, float z, int u, int v) {
-	V3 C = FragPointLight(B, z, u, v);
-	
-	const V3 pixelWorldPos = Frag_camera.UnprojectPoint(u, v, z);
+// with screen y pointing down, front faces have a negative signed area
+static bool BackFacing(const V3 &p0, const V3 &p1, const V3 &p2) {
+	const float area = (p1.x() - p0.x()) * (p2.y() - p0.y()) - (p1.y() - p0.y()) * (p2.x() - p0.x());
+	return area > 0.0f;
+}
+
+// skip the triangles that can't be seen and cut down the ones crossing the near plane or the
+// guard band, counting why in stats. everything left goes to emit(binned, p0, p1, p2), where
+// binned is the triangle, or its piece in clipped with CLIPPED_BIT set
+template <typename Emit>
+static void CullTriangles(const Mesh &mesh, const FrameBuffer &fb, const ScreenRect &clip, const PPCamera &camera, const V3 *projected,
+	std::vector<ClippedTriangle> &clipped, Mesh::CullStats &stats, const Emit &emit)
+{
+	for (size_t i = 0; i < mesh.triangleCount; i++) {
+		const unsigned int *tri = &mesh.triangles[i * 3];
+
+		const V3 &p0 = projected[tri[0]];
+		const V3 &p1 = projected[tri[1]];
+		const V3 &p2 = projected[tri[2]];
+
+		if (InsideGuardBand(camera, p0) && InsideGuardBand(camera, p1) && InsideGuardBand(camera, p2)) {
+			if (OffScreen(fb, clip, p0, p1, p2)) {
+				stats.offScreen++;
+			} else if (mesh.cullBackFaces && BackFacing(p0, p1, p2)) {
+				stats.backFacing++;
+			} else {
+				stats.drawn++;
+				emit((uint32_t) i, p0, p1, p2);
+			}
+			continue;
+		}
+
+		// crosses the near plane or is huge on screen, so it has to be cut down first
+		const V3 q0 = camera.CameraSpace(mesh.vertices[tri[0]], mesh.drawModel);
+		const V3 q1 = camera.CameraSpace(mesh.vertices[tri[1]], mesh.drawModel);
+		const V3 q2 = camera.CameraSpace(mesh.vertices[tri[2]], mesh.drawModel);
 
-	V3 shadowMapUV;
-	if (!Frag_lightCamera.ProjectPoint(pixelWorldPos, shadowMapUV))
-		return C * Frag_ka; // TODO: what if out of view/behind light source?
+		if (q0.z() <= PPCamera::NEAR_Z && q1.z() <= PPCamera::NEAR_Z && q2.z() <= PPCamera::NEAR_Z) {
+			stats.behindCamera++;
+			continue;
+		}
 
-	const float lightZ = Frag_lightBuffer.GetZ((int) shadowMapUV[0], (int) shadowMapUV[1]);
+		stats.clipped++;
 
-	// debug, colors the pixels based on the light's distance
-	// return V3(1, 1, 1) * (1.0f - (1.0f / (1.0f + lightZ * 0.1)));
+		const size_t first = clipped.size();
+		ClipTriangle(camera, (uint32_t) i, q0, q1, q2, clipped);
 
-	if (shadowMapUV.z() >= lightZ - Frag_epsilon) {
-		return C;
-	} else {
-		return C * Frag_ka;
+		// all the pieces lie in the same plane, so they all face the same way
+		bool anyEmitted = false, backFacing = false;
+		for (size_t piece = first; piece < clipped.size(); piece++) {
+			const ClippedTriangle &c = clipped[piece];
+
+			if (OffScreen(fb, clip, c.p0, c.p1, c.p2)) continue;
+			if (mesh.cullBackFaces && BackFacing(c.p0, c.p1, c.p2)) {
+				backFacing = true;
+				continue;
+			}
+
+			emit((uint32_t) piece | CLIPPED_BIT, c.p0, c.p1, c.p2);
+			anyEmitted = true;
+		}
+
+		if (anyEmitted) stats.drawn++;
+		else if (backFacing) stats.backFacing++;
+		else stats.offScreen++;
 	}
 }
 
-static FragShaderResult FragTextured(const V3 &, float, int u, int v) {
-	const V3 uv1 = V3(u, v, 1);
-	const float tx = (Frag_txABC * uv1) / (Frag_DEF * uv1);
-	const float ty = (Frag_tyABC * uv1) / (Frag_DEF * uv1);
+void Mesh::BinTriangles(const FrameBuffer &fb, const PPCamera &camera) {
+	BinTriangles(fb, camera, fb.Bounds());
+}
+
+void Mesh::BinTriangles(const FrameBuffer &fb, const PPCamera &camera, const ScreenRect &clip) {
+	binner.Begin(fb);
+	clippedTriangles.clear();
+	cullStats = CullStats{};
 
-	return Frag_texBuffer.GetColor(tx, ty, Frag_tileMode, Frag_filterMode);
+	CullTriangles(*this, fb, clip, camera, projectedVertices, clippedTriangles, cullStats,
+		[&](uint32_t binned, const V3 &p0, const V3 &p1, const V3 &p2) {
+			binner.Bin(binned, p0, p1, p2);
+		});
 }
 
-static FragShaderResult FragEnvMap(const V3 &, float z, int u, int v) {
-	const V3 uv1 = V3(u, v, 1);
-	const V3 N = V3(
-		(Frag_nxABC * uv1) / (Frag_DEF * uv1),
-		(Frag_nyABC * uv1) / (Frag_DEF * uv1),
-		(Frag_nzABC * uv1) / (Frag_DEF * uv1)
-	).Normalized();
+// rasterize a binned triangle. visit gets barycentric coordinates in the source triangle,
+// even for clipped pieces, so shaders can be set up from the mesh triangle as usual
+template <typename Visit>
+static void RasterizeBinned(FrameBuffer &fb, const Mesh &mesh, uint32_t binned, const ScreenRect &tile, const Visit &visit) {
+	if (binned & CLIPPED_BIT) {
+		const ClippedTriangle &piece = mesh.clippedTriangles[binned & ~CLIPPED_BIT];
 
-	const V3 eyeRay = (Frag_camera.UnprojectPoint(u, v, z) - Frag_camera.C).Normalized();
-	// const V3 N = (Frag_n0 * B[0] + Frag_n1 * B[1] + Frag_n2 * B[2]).Normalized();
-	const V3 RR = N.Reflect(eyeRay);
+		if constexpr (std::is_same_v<Visit, DepthOnlyVisit>) {
+			fb.RasterizeTriangle(piece.p0, piece.p1, piece.p2, tile, visit);
+			return;
+		}
 
-	// float highlightValue = std::powf(std::max(0.0f, eyeRay.Dot(RR.Normalized())), 50.0f);
-	// return V3(1, 1, 1) * highlightValue + Frag_cubeMap.Lookup(RR) * (1.0f - highlightValue);
+		fb.RasterizeTriangle(piece.p0, piece.p1, piece.p2, tile, [&](int bufferIndex, const V3 &B, float z, int u, int v) {
+			visit(bufferIndex, piece.toOriginal * B, z, u, v);
+		});
+	} else {
+		const unsigned int *tri = &mesh.triangles[binned * 3];
+		const V3 *projected = mesh.projectedVertices;
 
-	return Frag_cubeMap.Lookup(RR);
+		fb.RasterizeTriangle(projected[tri[0]], projected[tri[1]], projected[tri[2]], tile, visit);
+	}
 }
 
-void Mesh::DrawFilledNoLighting(FrameBuffer &fb, const PPCamera &camera) {
-	ProjectVertices(camera);
+// draw a binned triangle with a shader set up for its source triangle
+template <typename Frag>
+static void DrawBinned(FrameBuffer &fb, const Mesh &mesh, uint32_t binned, const ScreenRect &tile, const Frag &frag) {
+	RasterizeBinned(fb, mesh, binned, tile, [&](int bufferIndex, const V3 &B, float z, int u, int v) {
+		fb.cb[bufferIndex] = ColorFromV3(frag(B, z, u, v));
+	});
+}
 
-	for (size_t i = 0; i < triangleCount; i++) {
-		const unsigned int *tri = &triangles[i * 3];
+// fill in the point light shader's values for one triangle, placed by model
+static void SetupPointLight(FragPointLight &frag, const Mesh &mesh, const Transform *model, const unsigned int *tri) {
+	frag.p0 = model ? model->ApplyPoint(mesh.vertices[tri[0]]) : mesh.vertices[tri[0]];
+	frag.p1 = model ? model->ApplyPoint(mesh.vertices[tri[1]]) : mesh.vertices[tri[1]];
+	frag.p2 = model ? model->ApplyPoint(mesh.vertices[tri[2]]) : mesh.vertices[tri[2]];
 
-		const V3 &p0 = projectedVertices[tri[0]];
-		const V3 &p1 = projectedVertices[tri[1]];
-		const V3 &p2 = projectedVertices[tri[2]];
+	if (mesh.colors) {
+		frag.c0 = mesh.colors[tri[0]];
+		frag.c1 = mesh.colors[tri[1]];
+		frag.c2 = mesh.colors[tri[2]];
+	}
+	if (mesh.normals) {
+		frag.n0 = model ? model->ApplyDirection(mesh.normals[tri[0]]) : mesh.normals[tri[0]];
+		frag.n1 = model ? model->ApplyDirection(mesh.normals[tri[1]]) : mesh.normals[tri[1]];
+		frag.n2 = model ? model->ApplyDirection(mesh.normals[tri[2]]) : mesh.normals[tri[2]];
+	}
+}
+
+void Mesh::DrawFilledNoLighting(FrameBuffer &fb, const PPCamera &camera) {
+	ProjectVertices(camera);
+	BinTriangles(fb, camera);
 
-		if (p0.z() < 0.0f || p1.z() < 0.0f || p2.z() < 0.0f) continue;
+	binner.Flush([&](uint32_t binned, const ScreenRect &tile) {
+		const unsigned int *tri = &triangles[SourceTriangle(binned) * 3];
 
+		FragNoLight frag;
 		if (colors) {
-			Frag_c0 = colors[tri[0]];
-			Frag_c1 = colors[tri[1]];
-			Frag_c2 = colors[tri[2]];
+			frag.c0 = colors[tri[0]];
+			frag.c1 = colors[tri[1]];
+			frag.c2 = colors[tri[2]];
 		}
 
-		fb.DrawTriangle(p0, p1, p2, FragNoLight);
-	}
+		DrawBinned(fb, *this, binned, tile, frag);
+	});
 }
 
 // simple version
 void Mesh::DrawFilledPointLight(FrameBuffer &fb, const PPCamera &camera, const V3 &lightPos, float ka, float specularIntensity) {
 	ProjectVertices(camera);
 
-	Frag_camera = camera;
-	Frag_lightCamera.C = lightPos;
-	Frag_ka = ka;
-	Frag_specularIntensity = specularIntensity;
+	FragUniforms uniforms;
+	uniforms.camera = &camera;
+	uniforms.lightPos = lightPos;
+	uniforms.ka = ka;
+	uniforms.specularIntensity = specularIntensity;
 
-	for (size_t i = 0; i < triangleCount; i++) {
-		const unsigned int *tri = &triangles[i * 3];
-
-		const V3 &p0 = projectedVertices[tri[0]];
-		const V3 &p1 = projectedVertices[tri[1]];
-		const V3 &p2 = projectedVertices[tri[2]];
+	BinTriangles(fb, camera);
 
-		if (p0.z() < 0.0f || p1.z() < 0.0f || p2.z() < 0.0f) continue;
+	binner.Flush([&](uint32_t binned, const ScreenRect &tile) {
+		const unsigned int *tri = &triangles[SourceTriangle(binned) * 3];
 
-		Frag_p0 = vertices[tri[0]];
-		Frag_p1 = vertices[tri[1]];
-		Frag_p2 = vertices[tri[2]];
-
-		if (colors) {
-			Frag_c0 = colors[tri[0]];
-			Frag_c1 = colors[tri[1]];
-			Frag_c2 = colors[tri[2]];
-		}
-		if (normals) {
-			Frag_n0 = normals[tri[0]];
-			Frag_n1 = normals[tri[1]];
-			Frag_n2 = normals[tri[2]];
-		}
+		FragPointLight frag;
+		frag.uniforms = &uniforms;
+		SetupPointLight(frag, *this, drawModel, tri);
 
-		fb.DrawTriangle(p0, p1, p2, FragPointLight);
-	}
+		DrawBinned(fb, *this, binned, tile, frag);
+	});
 }
 
 // shadow map version
 void Mesh::DrawFilledPointLight(FrameBuffer &fb, const PPCamera &camera,
-	const PPCamera &lightCamera, const FrameBuffer &lightBuffer,
+	const PPCamera &lightCamera, const ShadowSampler &shadow,
 	float ka, float specularIntensity)
 {
 	ProjectVertices(camera);
 
-	Frag_camera = camera;
-	Frag_lightCamera = lightCamera;
-	Frag_lightBuffer = lightBuffer;
-	Frag_ka = ka;
-	Frag_specularIntensity = specularIntensity;
-	Frag_epsilon = 0.3f;
+	FragUniforms uniforms;
+	uniforms.camera = &camera;
+	SetShadowMap(uniforms, camera, lightCamera, shadow);
+	uniforms.ka = ka;
+	uniforms.specularIntensity = specularIntensity;
+	uniforms.epsilon = 0.3f;
 
 	assert(colors != nullptr && "lighting requires colors");
 	assert(normals != nullptr && "lighting requires normals");
 
-	for (size_t i = 0; i < triangleCount; i++) {
-		const unsigned int *tri = &triangles[i * 3];
+	BinTriangles(fb, camera);
 
-		const V3 &p0 = projectedVertices[tri[0]];
-		const V3 &p1 = projectedVertices[tri[1]];
-		const V3 &p2 = projectedVertices[tri[2]];
+	binner.Flush([&](uint32_t binned, const ScreenRect &tile) {
+		const unsigned int *tri = &triangles[SourceTriangle(binned) * 3];
 
-		if (p0.z() < 0.0f || p1.z() < 0.0f || p2.z() < 0.0f) continue;
+		FragPointLightShadowMap frag;
+		frag.uniforms = &uniforms;
+		SetupPointLight(frag, *this, drawModel, tri);
 
-		Frag_p0 = vertices[tri[0]];
-		Frag_p1 = vertices[tri[1]];
-		Frag_p2 = vertices[tri[2]];
+		DrawBinned(fb, *this, binned, tile, frag);
+	});
+}
 
-		Frag_c0 = colors[tri[0]];
-		Frag_c1 = colors[tri[1]];
-		Frag_c2 = colors[tri[2]];
+// cube shadow map version
+void Mesh::DrawFilledPointLight(FrameBuffer &fb, const PPCamera &camera,
+	const CubeShadowMap &shadow,
+	float ka, float specularIntensity)
+{
+	ProjectVertices(camera);
 
-		Frag_n0 = normals[tri[0]];
-		Frag_n1 = normals[tri[1]];
-		Frag_n2 = normals[tri[2]];
+	FragUniforms uniforms;
+	uniforms.camera = &camera;
+	uniforms.lightPos = shadow.Center();
+	uniforms.cubeShadow = &shadow;
+	uniforms.ka = ka;
+	uniforms.specularIntensity = specularIntensity;
+	uniforms.epsilon = 0.3f;
 
-		fb.DrawTriangle(p0, p1, p2, FragPointLightShadowMap);
-	}
+	assert(colors != nullptr && "lighting requires colors");
+	assert(normals != nullptr && "lighting requires normals");
+
+	BinTriangles(fb, camera);
+
+	binner.Flush([&](uint32_t binned, const ScreenRect &tile) {
+		const unsigned int *tri = &triangles[SourceTriangle(binned) * 3];
+
+		FragPointLightCubeShadow frag;
+		frag.uniforms = &uniforms;
+		SetupPointLight(frag, *this, drawModel, tri);
+
+		DrawBinned(fb, *this, binned, tile, frag);
+	});
 }
 
-void Mesh::DrawTextured(FrameBuffer &fb, const PPCamera &camera, FrameBuffer &tex, int filterMode, int tileMode) {
+void Mesh::DrawTextured(FrameBuffer &fb, const PPCamera &camera, const FrameBuffer &tex, int filterMode, int tileMode) {
 
 	ProjectVertices(camera);
 
-	Frag_camera = camera;
-	Frag_texBuffer = tex;
-	Frag_filterMode = filterMode;
-	Frag_tileMode = tileMode;
+	FragUniforms uniforms;
+	uniforms.camera = &camera;
+	uniforms.texBuffer = &tex;
+	uniforms.filterMode = filterMode;
+	uniforms.tileMode = tileMode;
 
 	assert(tcs != nullptr && "textures requires texture coordinates");
 
 	const M3 abc = M3::FromColumns(camera.a, camera.b, camera.c);
 
-	for (size_t i = 0; i < triangleCount; i++) {
-		const unsigned int *tri = &triangles[i * 3];
+	BinTriangles(fb, camera);
+
+	binner.Flush([&](uint32_t binned, const ScreenRect &tile) {
+		const unsigned int *tri = &triangles[SourceTriangle(binned) * 3];
 
 		const M3 Q = M3::FromColumns(
-			vertices[tri[0]] - camera.C,
-			vertices[tri[1]] - camera.C,
-			vertices[tri[2]] - camera.C
+			WorldVertex(tri[0]) - camera.C,
+			WorldVertex(tri[1]) - camera.C,
+			WorldVertex(tri[2]) - camera.C
 		).Inverse() * abc;
 
 		const V3 texX = V3(tcs[2 * tri[0]], tcs[2 * tri[1]], tcs[2 * tri[2]]);
 		const V3 texY = V3(tcs[2 * tri[0]+1], tcs[2 * tri[1]+1], tcs[2 * tri[2]+1]);
 
-		Frag_txABC = Q.Transpose() * texX;
-		Frag_tyABC = Q.Transpose() * texY;
-		Frag_DEF = Q.ColumnSums();
+		FragTextured frag;
+		frag.uniforms = &uniforms;
+		frag.txABC = Q.Transpose() * texX;
+		frag.tyABC = Q.Transpose() * texY;
+		frag.DEF = Q.ColumnSums();
+
+		DrawBinned(fb, *this, binned, tile, frag);
+	});
 
-		const V3 &p0 = projectedVertices[tri[0]];
-		const V3 &p1 = projectedVertices[tri[1]];
-		const V3 &p2 = projectedVertices[tri[2]];
+}
 
-		if (p0.z() < 0.0f || p1.z() < 0.0f || p2.z() < 0.0f) continue;
+void Mesh::DrawTextured(FrameBuffer &fb, const PPCamera &camera, const Texture &tex, int filterMode, int tileMode) {
 
-		fb.DrawTriangleCorrect(p0, p1, p2, FragTextured);
-	}
+	ProjectVertices(camera);
+
+	FragUniforms uniforms;
+	uniforms.camera = &camera;
+	uniforms.texture = &tex;
+	uniforms.filterMode = filterMode;
+	uniforms.tileMode = tileMode;
+
+	assert(tcs != nullptr && "textures requires texture coordinates");
+
+	const M3 abc = M3::FromColumns(camera.a, camera.b, camera.c);
+
+	BinTriangles(fb, camera);
+
+	binner.Flush([&](uint32_t binned, const ScreenRect &tile) {
+		const unsigned int *tri = &triangles[SourceTriangle(binned) * 3];
+
+		const M3 Q = M3::FromColumns(
+			WorldVertex(tri[0]) - camera.C,
+			WorldVertex(tri[1]) - camera.C,
+			WorldVertex(tri[2]) - camera.C
+		).Inverse() * abc;
+
+		const V3 texX = V3(tcs[2 * tri[0]], tcs[2 * tri[1]], tcs[2 * tri[2]]);
+		const V3 texY = V3(tcs[2 * tri[0]+1], tcs[2 * tri[1]+1], tcs[2 * tri[2]+1]);
+
+		FragTexturedMip frag;
+		frag.uniforms = &uniforms;
+		frag.txABC = Q.Transpose() * texX;
+		frag.tyABC = Q.Transpose() * texY;
+		frag.DEF = Q.ColumnSums();
+
+		DrawBinned(fb, *this, binned, tile, frag);
+	});
 
 }
 
-void Mesh::DrawFilledEnvMap(FrameBuffer &fb, const PPCamera &camera, CubeMap &map) {
+void Mesh::DrawFilledEnvMap(FrameBuffer &fb, const PPCamera &camera, const CubeMap &map) {
 	ProjectVertices(camera);
 
-	Frag_meshCenter = GetCenter();
-	Frag_camera = camera;
-	Frag_cubeMap = map;
+	FragUniforms uniforms;
+	uniforms.camera = &camera;
+	uniforms.cubeMap = &map;
 
 	const M3 abc = M3::FromColumns(camera.a, camera.b, camera.c);
 
 	assert(normals && "env map requires normals");
 
-	for (size_t i = 0; i < triangleCount; i++) {
-		const unsigned int *tri = &triangles[i * 3];
-
-		const V3 &p0 = projectedVertices[tri[0]];
-		const V3 &p1 = projectedVertices[tri[1]];
-		const V3 &p2 = projectedVertices[tri[2]];
+	BinTriangles(fb, camera);
 
-		if (p0.z() < 0.0f || p1.z() < 0.0f || p2.z() < 0.0f) continue;
+	binner.Flush([&](uint32_t binned, const ScreenRect &tile) {
+		const unsigned int *tri = &triangles[SourceTriangle(binned) * 3];
 
 		const M3 Q = M3::FromColumns(
-			vertices[tri[0]] - camera.C,
-			vertices[tri[1]] - camera.C,
-			vertices[tri[2]] - camera.C
+			WorldVertex(tri[0]) - camera.C,
+			WorldVertex(tri[1]) - camera.C,
+			WorldVertex(tri[2]) - camera.C
 		).Inverse() * abc;
 
-		Frag_nxABC = Q.Transpose() * V3(normals[tri[0]].x(), normals[tri[1]].x(), normals[tri[2]].x());
-		Frag_nyABC = Q.Transpose() * V3(normals[tri[0]].y(), normals[tri[1]].y(), normals[tri[2]].y());
-		Frag_nzABC = Q.Transpose() * V3(normals[tri[0]].z(), normals[tri[1]].z(), normals[tri[2]].z());
-		Frag_DEF = Q.ColumnSums();
+		FragEnvMap frag;
+		frag.uniforms = &uniforms;
+		const V3 n0 = WorldNormal(tri[0]), n1 = WorldNormal(tri[1]), n2 = WorldNormal(tri[2]);
+		frag.nxABC = Q.Transpose() * V3(n0.x(), n1.x(), n2.x());
+		frag.nyABC = Q.Transpose() * V3(n0.y(), n1.y(), n2.y());
+		frag.nzABC = Q.Transpose() * V3(n0.z(), n1.z(), n2.z());
+		frag.DEF = Q.ColumnSums();
 
-		fb.DrawTriangleCorrect(p0, p1, p2, FragEnvMap);
-	}
+		DrawBinned(fb, *this, binned, tile, frag);
+	});
+}
+
+void Mesh::DrawDepthOnly(FrameBuffer &fb, const PPCamera &camera) {
+	DrawDepthOnly(fb, camera, fb.Bounds());
+}
+
+void Mesh::DrawDepthOnly(FrameBuffer &fb, const PPCamera &camera, const ScreenRect &clip) {
+	ProjectVertices(camera);
+
+	BinTriangles(fb, camera, clip);
+
+	// the rasterizer does the z test and write on its own
+	binner.Flush([&](uint32_t binned, const ScreenRect &tile) {
+		const ScreenRect inside = tile.Intersect(clip);
+		if (!inside.Empty()) RasterizeBinned(fb, *this, binned, inside, DepthOnlyVisit());
+	});
+}
+
+void Mesh::DrawDepthOnly(FrameBuffer &fb, const PPCamera &camera, DrawScratch &scratch) const {
+	if (vertices == nullptr || vertexCount == 0) return;
+
+	scratch.projected.resize(vertexCount);
+	ProjectVertices(camera, scratch.projected.data());
+	scratch.clipped.clear();
+
+	// straight to the rasterizer in submission order, with nothing shared to bin into
+	const ScreenRect bounds = fb.Bounds();
+	CullStats stats = {};
+	CullTriangles(*this, fb, bounds, camera, scratch.projected.data(), scratch.clipped, stats,
+		[&](uint32_t, const V3 &p0, const V3 &p1, const V3 &p2) {
+			fb.RasterizeTriangle(p0, p1, p2, bounds, DepthOnlyVisit());
+		});
+}
+
+void Mesh::DrawVisibility(FrameBuffer &fb, GBuffer &gb, const PPCamera &camera) {
+	assert(fb.w == gb.w && fb.h == gb.h && "g buffer must match the frame buffer");
+
+	ProjectVertices(camera);
+
+	const uint16_t meshId = gb.AddMesh(this, drawModel ? *drawModel : Transform());
+
+	BinTriangles(fb, camera);
+
+	binner.Flush([&](uint32_t binned, const ScreenRect &tile) {
+		const uint32_t triangle = SourceTriangle(binned);
+
+		RasterizeBinned(fb, *this, binned, tile, [&](int bufferIndex, const V3 &B, float, int, int) {
+			gb.triangleIds[bufferIndex] = triangle;
+			gb.meshIds[bufferIndex] = meshId;
+			gb.barycentrics[bufferIndex] = B;
+		});
+	});
+}
+
+// runs frag on every pixel of gb that has a triangle, split by rows across the thread pool
+template <typename Frag>
+static void ShadeGBuffer(FrameBuffer &fb, const GBuffer &gb, const FragUniforms &uniforms) {
+	assert(fb.w == gb.w && fb.h == gb.h && "g buffer must match the frame buffer");
+
+	ThreadPool::Global().ParallelFor(fb.h, [&](size_t row) {
+		const int v = (int) row;
+
+		// neighbouring pixels are usually the same triangle, so only set it up when it changes
+		Frag frag;
+		frag.uniforms = &uniforms;
+		uint32_t lastTriangle = GBuffer::NO_TRIANGLE;
+		uint16_t lastMesh = 0;
+
+		for (int u = 0; u < fb.w; u++) {
+			const int i = fb.Index(u, v);
+			const uint32_t triangle = gb.triangleIds[i];
+			if (triangle == GBuffer::NO_TRIANGLE) continue;
+
+			if (triangle != lastTriangle || gb.meshIds[i] != lastMesh) {
+				const Mesh &mesh = *gb.meshes[gb.meshIds[i]];
+				SetupPointLight(frag, mesh, &gb.models[gb.meshIds[i]], &mesh.triangles[triangle * 3]);
+				lastTriangle = triangle;
+				lastMesh = gb.meshIds[i];
+			}
+
+			fb.cb[i] = ColorFromV3(frag(gb.barycentrics[i], fb.zb[i], u, v));
+		}
+	});
+}
+
+// simple version
+void Mesh::ShadeDeferred(FrameBuffer &fb, const GBuffer &gb, const PPCamera &camera, const V3 &lightPos, float ka, float specularIntensity) {
+	FragUniforms uniforms;
+	uniforms.camera = &camera;
+	uniforms.lightPos = lightPos;
+	uniforms.ka = ka;
+	uniforms.specularIntensity = specularIntensity;
+
+	ShadeGBuffer<FragPointLight>(fb, gb, uniforms);
+}
+
+// shadow map version
+void Mesh::ShadeDeferred(FrameBuffer &fb, const GBuffer &gb, const PPCamera &camera,
+	const PPCamera &lightCamera, const ShadowSampler &shadow,
+	float ka, float specularIntensity)
+{
+	FragUniforms uniforms;
+	uniforms.camera = &camera;
+	SetShadowMap(uniforms, camera, lightCamera, shadow);
+	uniforms.ka = ka;
+	uniforms.specularIntensity = specularIntensity;
+	uniforms.epsilon = 0.3f;
+
+	ShadeGBuffer<FragPointLightShadowMap>(fb, gb, uniforms);
+}
+
+// cube shadow map version
+void Mesh::ShadeDeferred(FrameBuffer &fb, const GBuffer &gb, const PPCamera &camera,
+	const CubeShadowMap &shadow,
+	float ka, float specularIntensity)
+{
+	FragUniforms uniforms;
+	uniforms.camera = &camera;
+	uniforms.lightPos = shadow.Center();
+	uniforms.cubeShadow = &shadow;
+	uniforms.ka = ka;
+	uniforms.specularIntensity = specularIntensity;
+	uniforms.epsilon = 0.3f;
+
+	ShadeGBuffer<FragPointLightCubeShadow>(fb, gb, uniforms);
 }
 
 void Mesh::DrawNormals(FrameBuffer &fb, const PPCamera &camera) const {
@@ -599,8 +1211,8 @@ void Mesh::DrawNormals(FrameBuffer &fb, const PPCamera &camera) const {
 
 	for (size_t i = 0; i < vertexCount; i++) {
 
-		if (!camera.ProjectPoint(vertices[i], p0)) continue;
-		if (!camera.ProjectPoint(vertices[i] + normals[i].Normalized() * 5, p1)) continue;
+		if (!camera.ProjectPoint(WorldVertex(i), p0)) continue;
+		if (!camera.ProjectPoint(WorldVertex(i) + WorldNormal(i).Normalized() * 5, p1)) continue;
 
 		fb.DrawLine(p0, p1, colors[i], V3(1, 1, 1));
 	}
@@ -612,6 +1224,7 @@ void Mesh::SetTriangle(size_t index, unsigned int v0, unsigned int v1, unsigned
 		triangles[index * 3 + 0] = v0;
 		triangles[index * 3 + 1] = v1;
 		triangles[index * 3 + 2] = v2;
+		MarkChanged();
 	}
 }
 
@@ -619,5 +1232,6 @@ void Mesh::SetTcs(size_t index, float x, float y) {
 	if (tcs && index < vertexCount) {
 		tcs[2 * index + 0] = x;
 		tcs[2 * index + 1] = y;
+		MarkChanged();
 	}
 }
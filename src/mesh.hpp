@@ -2,10 +2,30 @@
 #define MESH_HPP
 
 #include "aabb.hpp"
+#include "clipper.hpp"
 #include "cube_map.hpp"
 #include "frame_buffer.hpp"
+#include "g_buffer.hpp"
+#include "mapped_file.hpp"
+#include "math/transform.hpp"
 #include "math/v3.hpp"
 #include "ppcamera.hpp"
+#include "shadow_sampler.hpp"
+#include "texture.hpp"
+#include "tile_binner.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+struct CubeShadowMap;
+
+// space for a draw to work in, for draws that can't use the mesh's own because several
+// of them run at once, one per buffer. see DrawDepthOnly
+struct DrawScratch {
+	std::vector<V3> projected;
+	std::vector<ClippedTriangle> clipped;
+};
 
 struct Mesh {
 	V3 *vertices;
@@ -20,16 +40,70 @@ struct Mesh {
 	size_t triangleCount;
 	float *tcs;
 
+	// model transform for the draw in progress, nullptr when the vertices are already in
+	// world space. set by DrawInstances, the vertex data itself is never changed
+	const Transform *drawModel;
+
+	// skip triangles facing away from the camera when drawing.
+	// only safe for closed meshes, open ones will have holes
+	bool cullBackFaces;
+
+	// how many triangles the last draw call skipped before rasterizing, and why
+	struct CullStats {
+		size_t drawn;
+		size_t behindCamera;
+		size_t backFacing;
+		size_t offScreen;
+		// crossed the near plane or the guard band and were cut down, also counted above
+		size_t clipped;
+	};
+	CullStats cullStats;
+
+	// scratch space for drawing, kept per mesh so different meshes can be drawn at once.
+	// sorts each draw's triangles into screen tiles for the thread pool
+	TileBinner binner;
+	// pieces of the triangles that had to be clipped in the current draw
+	std::vector<ClippedTriangle> clippedTriangles;
+
+	// the file a loaded mesh's arrays point into, instead of owning them
+	std::unique_ptr<MappedFile> mappedFile;
+
 	// store this so we don't waste time recomputing it,
 	// we only update this when the model is modified
 	V3 centerOfMass;
 
+	// goes up every time the vertex data or triangles change, so things drawn from the mesh
+	// (see ShadowMapCache) can tell when they're out of date. the methods here keep it
+	// up to date, call MarkChanged after writing the arrays directly
+	uint64_t version;
+	inline void MarkChanged(void) { version++; }
+
 	// creates an empty mesh
 	Mesh();
 	~Mesh();
 
 	V3 GetCenter(void) const;
 
+	// vertex and normal i placed by drawModel
+	inline V3 WorldVertex(size_t i) const {
+		return drawModel ? drawModel->ApplyPoint(vertices[i]) : vertices[i];
+	}
+	inline V3 WorldNormal(size_t i) const {
+		return drawModel ? drawModel->ApplyDirection(normals[i]) : normals[i];
+	}
+
+	// instanced drawing. calls draw once per model transform with this mesh placed by it,
+	// so one loaded mesh can be drawn anywhere any number of times without copying it:
+	//   mesh.DrawInstances(models, [&] { mesh.DrawFilledNoLighting(fb, camera); });
+	template <typename Draw>
+	void DrawInstances(const std::vector<Transform> &models, const Draw &draw) {
+		for (const Transform &model : models) {
+			drawModel = &model;
+			draw();
+		}
+		drawModel = nullptr;
+	}
+
 	void UpdateCenterOfMass(void);
 
 	// move the model by the given delta
@@ -40,14 +114,26 @@ struct Mesh {
 	// uniform scaling around center of mass
 	void Scale(const float &scale);
 
+	// apply transform to every vertex and normal in one pass, on the thread pool for big meshes.
+	// normals only get the linear part, so it should be a rotation
+	void ApplyTransform(const Transform &transform);
+
 	void RotateAroundAxis(const V3 &origin, const V3 &axis, float theta);
 	void RotateAroundDirection(const V3 &axis, float theta);
 
 	// set this mesh to empty
 	void Reset(void);
 
-	// load model from a binary file
+	// load model from a binary file, either a .bin or a compact mesh
 	void Load(const std::string &path);
+	// save in the compact format (see compact_mesh.hpp). positions and texture coordinates are
+	// rounded to 1/65535 of their range, normals to about 0.003 degrees and colors to 8 bits
+	bool SaveCompact(const std::string &path) const;
+
+	// reorder the triangles so the ones sharing vertices are drawn together, and renumber
+	// the vertices in the order they're first used. drawing then reuses vertices while they're
+	// still in cache instead of jumping around the arrays. prints the cache miss ratio before and after
+	void OptimizeVertexCache(void);
 
 	// create rectangle from center position and dimensions
 	void LoadRectangle(const V3 &center, const V3 &dimensions, const V3 &color);
@@ -64,6 +150,8 @@ struct Mesh {
 	AABB GetAABB(void) const;
 
 	void ProjectVertices(const PPCamera &camera);
+	// into projected instead of projectedVertices, vertexCount of them
+	void ProjectVertices(const PPCamera &camera, V3 *projected) const;
 
 	// draw only the vertices
 	void DrawVertices(FrameBuffer &fb, const PPCamera &camera, size_t pointSize) const;
@@ -74,16 +162,48 @@ struct Mesh {
 	// draw filled triangles with interpolated colors with lighting from a single point light
 	void DrawFilledPointLight(FrameBuffer &fb, const PPCamera &camera, const V3 &lightPos, float ka, float specularIntensity);
 
-	void DrawTextured(FrameBuffer &fb, const PPCamera &camera, FrameBuffer &tex, int filterMode=0, int tileMode=0);
-
-	void DrawFilledPointLight(FrameBuffer &fb, const PPCamera &camera, const PPCamera &lightCamera, const FrameBuffer &lightBuffer, float ka, float specularIntensity);
-
-	void DrawFilledEnvMap(FrameBuffer &fb, const PPCamera &camera, CubeMap &map);
+	void DrawTextured(FrameBuffer &fb, const PPCamera &camera, const FrameBuffer &tex, int filterMode=0, int tileMode=0);
+	// mipmapped version, filterMode is a Texture::Filter
+	void DrawTextured(FrameBuffer &fb, const PPCamera &camera, const Texture &tex, int filterMode=0, int tileMode=0);
+
+	// shadowed by what lightCamera sees, shadow has to be prepared from its depth
+	void DrawFilledPointLight(FrameBuffer &fb, const PPCamera &camera, const PPCamera &lightCamera, const ShadowSampler &shadow, float ka, float specularIntensity);
+	// shadowed in every direction around the light at shadow's center
+	void DrawFilledPointLight(FrameBuffer &fb, const PPCamera &camera, const CubeShadowMap &shadow, float ka, float specularIntensity);
+
+	void DrawFilledEnvMap(FrameBuffer &fb, const PPCamera &camera, const CubeMap &map);
+
+	// only fills fb's z buffer, with no shading or color work at all. for shadow maps (fb can
+	// be a DepthBuffer) and for finding what's covered before drawing for real
+	void DrawDepthOnly(FrameBuffer &fb, const PPCamera &camera);
+	// only touching the pixels inside clip, to redraw part of a buffer
+	void DrawDepthOnly(FrameBuffer &fb, const PPCamera &camera, const ScreenRect &clip);
+	// the same, but on the calling thread and only touching scratch, so draws into
+	// different buffers can run at the same time. cullStats isn't updated
+	void DrawDepthOnly(FrameBuffer &fb, const PPCamera &camera, DrawScratch &scratch) const;
+
+	// deferred shading. DrawVisibility only fills fb's z buffer and gb, and once every mesh
+	// is drawn ShadeDeferred shades each visible pixel exactly once, the same as
+	// DrawFilledPointLight would have. fb and gb need to be cleared/reset together beforehand
+	void DrawVisibility(FrameBuffer &fb, GBuffer &gb, const PPCamera &camera);
+	static void ShadeDeferred(FrameBuffer &fb, const GBuffer &gb, const PPCamera &camera, const V3 &lightPos, float ka, float specularIntensity);
+	static void ShadeDeferred(FrameBuffer &fb, const GBuffer &gb, const PPCamera &camera, const PPCamera &lightCamera, const ShadowSampler &shadow, float ka, float specularIntensity);
+	static void ShadeDeferred(FrameBuffer &fb, const GBuffer &gb, const PPCamera &camera, const CubeShadowMap &shadow, float ka, float specularIntensity);
 
 	void DrawNormals(FrameBuffer &fb, const PPCamera &camera) const;
 
 	void SetTriangle(size_t index, unsigned int v0, unsigned int v1, unsigned int v2);
 	void SetTcs(size_t index, float x, float y);
+
+private:
+	// decode a compact mesh file into new arrays
+	void LoadCompact(const MappedFile &file, const std::string &path);
+	// cull and clip the projected triangles and sort the rest into screen tiles for drawing.
+	// triangles missing clip are culled as off screen
+	void BinTriangles(const FrameBuffer &fb, const PPCamera &camera);
+	void BinTriangles(const FrameBuffer &fb, const PPCamera &camera, const ScreenRect &clip);
+	// the mesh triangle a binned triangle came from
+	uint32_t SourceTriangle(uint32_t binned) const;
 	
 };
 
@@ -3,6 +3,7 @@
 #include "math/v3.hpp"
 #include "math/m3.hpp"
 #include "gl.hpp"
+#include "simd.hpp"
 
 #include <OpenGL/gl.h>
 #include <iostream>
@@ -62,13 +63,18 @@ PPCamera PPCamera::Interpolate(const PPCamera &o, float t) const {
 	return out;
 }
 
+V3 PPCamera::CameraSpace(const V3 &P) const {
+	return MInv * (P - C);
+}
+
 bool PPCamera::ProjectPoint(const V3 &P, V3 &projectedP) const {
 	// q = <u, v, 1> * x
-	V3 q = MInv * (P - C);
+	return ProjectCameraSpace(CameraSpace(P), projectedP);
+}
 
+bool PPCamera::ProjectCameraSpace(const V3 &q, V3 &projectedP) const {
 	// behind the eye, bad point
-	// note: if this is instead 0.0f, there is extreme lag at certain points
-	if (q.z() <= 0.001f) {
+	if (q.z() <= NEAR_Z) {
 		return false;
 	}
 
@@ -82,6 +88,93 @@ bool PPCamera::ProjectPoint(const V3 &P, V3 &projectedP) const {
 	return true;
 }
 
+// model and view transforms in one, q = MInv * (model * P - C) = A * P + b
+static inline void FoldModel(const PPCamera &camera, const Transform *model, M3 &A, V3 &b) {
+	A = model ? camera.MInv * model->linear : camera.MInv;
+	b = camera.MInv * ((model ? model->translation : V3()) - camera.C);
+}
+
+// q = A * P + b. the SIMD version does exactly the same float operations in the same order
+static inline V3 TransformOne(const M3 &A, const V3 &b, float x, float y, float z) {
+	return V3(
+		A[0][0] * x + A[0][1] * y + A[0][2] * z + b[0],
+		A[1][0] * x + A[1][1] * y + A[1][2] * z + b[1],
+		A[2][0] * x + A[2][1] * y + A[2][2] * z + b[2]
+	);
+}
+
+V3 PPCamera::CameraSpace(const V3 &P, const Transform *model) const {
+	M3 A;
+	V3 b;
+	FoldModel(*this, model, A, b);
+	return TransformOne(A, b, P.x(), P.y(), P.z());
+}
+
+// TransformOne, then ProjectCameraSpace but with one divide for 1 / q.z
+static inline void ProjectOne(const M3 &A, const V3 &b, float x, float y, float z, V3 &projected) {
+	const V3 q = TransformOne(A, b, x, y, z);
+	projected = PPCamera::PerspectiveDivide(q);
+	if (!(q.z() > PPCamera::NEAR_Z)) projected.z() = -1.0f;
+}
+
+#if SIMD_X86
+
+// returns how many points were projected, a multiple of 8
+TARGET_AVX2 static size_t ProjectPoints8(const M3 &A, const V3 &b, const float *xs, const float *ys, const float *zs, size_t count, V3 *projected) {
+	__m256 m[3][3], t[3];
+	for (int r = 0; r < 3; r++) {
+		for (int c = 0; c < 3; c++) m[r][c] = _mm256_set1_ps(A[r][c]);
+		t[r] = _mm256_set1_ps(b[r]);
+	}
+	const __m256 nearZ = _mm256_set1_ps(PPCamera::NEAR_Z);
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 minusOne = _mm256_set1_ps(-1.0f);
+
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		const __m256 x = _mm256_loadu_ps(xs + i);
+		const __m256 y = _mm256_loadu_ps(ys + i);
+		const __m256 z = _mm256_loadu_ps(zs + i);
+
+		__m256 q[3];
+		for (int r = 0; r < 3; r++) {
+			q[r] = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(
+				_mm256_mul_ps(m[r][0], x), _mm256_mul_ps(m[r][1], y)), _mm256_mul_ps(m[r][2], z)), t[r]);
+		}
+
+		const __m256 rz = _mm256_div_ps(one, q[2]);
+		const __m256 inFront = _mm256_cmp_ps(q[2], nearZ, _CMP_GT_OQ);
+
+		alignas(32) float u[8], v[8], w[8];
+		_mm256_store_ps(u, _mm256_mul_ps(q[0], rz));
+		_mm256_store_ps(v, _mm256_mul_ps(q[1], rz));
+		_mm256_store_ps(w, _mm256_blendv_ps(minusOne, rz, inFront));
+
+		for (int lane = 0; lane < 8; lane++) {
+			projected[i + lane] = V3(u[lane], v[lane], w[lane]);
+		}
+	}
+
+	return i;
+}
+
+#endif // SIMD_X86
+
+void PPCamera::ProjectPoints(const float *xs, const float *ys, const float *zs, size_t count, V3 *projected, const Transform *model) const {
+	M3 A;
+	V3 b;
+	FoldModel(*this, model, A, b);
+
+	size_t i = 0;
+#if SIMD_X86
+	if (GetSimdLevel() >= SIMD_AVX2) i = ProjectPoints8(A, b, xs, ys, zs, count, projected);
+#endif
+
+	for (; i < count; i++) {
+		ProjectOne(A, b, xs[i], ys[i], zs[i], projected[i]);
+	}
+}
+
 V3 PPCamera::UnprojectPoint(int u, int v, float invZ) const {
 	return C + (
 		a * (0.5f + (float) u) +
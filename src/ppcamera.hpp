@@ -3,8 +3,15 @@
 
 #include "math/v3.hpp"
 #include "math/m3.hpp"
+#include "math/transform.hpp"
+
+#include <cstddef>
 
 struct PPCamera {
+	// points closer than this (in camera space z) can't be projected.
+	// note: if this is instead 0.0f, there is extreme lag at certain points
+	static constexpr float NEAR_Z = 0.001f;
+
 	int w, h;
 	V3 C;
 	V3 a, b, c;
@@ -34,8 +41,28 @@ struct PPCamera {
 		return Interpolate(o, t * t * (3 - 2 * t));
 	}
 
+	// q = <u * w, v * w, w>, the point before the perspective divide
+	V3 CameraSpace(const V3 &P) const;
+	// CameraSpace for P placed by model first if it isn't nullptr, rounded exactly the way
+	// ProjectPoints does it. the clipper starts from this, so a vertex it keeps projects
+	// to the same bits as it does in the triangles next to it that weren't clipped
+	V3 CameraSpace(const V3 &P, const Transform *model) const;
+
+	// <u, v, 1 / w> for q in front of the near plane, with the same one divide as ProjectPoints
+	static inline V3 PerspectiveDivide(const V3 &q) {
+		const float r = 1.0f / q.z();
+		return V3(q.x() * r, q.y() * r, r);
+	}
+
 	// returns true if the point is within view
 	bool ProjectPoint(const V3 &P, V3 &projectedP) const;
+	// ProjectPoint for a point already in camera space
+	bool ProjectCameraSpace(const V3 &q, V3 &projectedP) const;
+
+	// ProjectPoint for count points at once, given as separate x, y and z arrays, placed by
+	// model first if it isn't nullptr. points that can't be projected get a z of -1.
+	// does 8 points at a time with AVX2, and every SIMD level gives exactly the same result
+	void ProjectPoints(const float *xs, const float *ys, const float *zs, size_t count, V3 *projected, const Transform *model = nullptr) const;
 
 	V3 UnprojectPoint(int u, int v, float invZ) const;
 
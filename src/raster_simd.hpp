@@ -0,0 +1,151 @@
+#ifndef RASTER_SIMD_HPP
+#define RASTER_SIMD_HPP
+
+#include "simd.hpp"
+
+#include <cmath>
+
+// the inner loop of FrameBuffer::RasterizeTriangle, one pixel at a time and SIMD versions.
+//
+// vertices are snapped to 28.4 fixed point (1/16th of a pixel), and the edge functions are
+// evaluated on those integers. every product fits well inside a double's 53 bit mantissa,
+// so the doubles hold the exact integer result no matter the order things are added in.
+// that makes coverage exact: pixels on an edge shared by two triangles go to exactly one of them,
+// picked by the top-left rule. all versions do the same float operations after that,
+// so they give bit for bit the same z and barycentric coordinates
+
+// sub-pixel steps per pixel
+constexpr int SUBPIXEL_STEPS = 16;
+
+// a coordinate in pixels to 28.4 fixed point, kept in a double
+inline double SnapToSubpixel(float x) {
+	return std::floor((double) x * SUBPIXEL_STEPS + 0.5);
+}
+
+// one row of a triangle, see FrameBuffer::RasterizeTriangle
+struct RasterRow {
+	// edge function of each vertex's opposite edge at x = 0, and how much it changes per pixel
+	double E0, E1, E2;
+	double A0, A1, A2;
+	// 0 for top and left edges, which own the pixels exactly on them. -1 for the rest
+	double bias0, bias1, bias2;
+	// 1 / twice the triangle's area, turns edge functions into barycentric coordinates
+	double invArea;
+	// z of each vertex
+	float z0, z1, z2;
+};
+
+// returns true if pixel x is inside the triangle, filling in its barycentric coordinates
+inline bool RasterPixel(const RasterRow &row, int x, float &B0, float &B1, float &B2) {
+	const double e0 = row.E0 + x * row.A0;
+	const double e1 = row.E1 + x * row.A1;
+	const double e2 = row.E2 + x * row.A2;
+
+	if (e0 + row.bias0 < 0 || e1 + row.bias1 < 0 || e2 + row.bias2 < 0) return false;
+
+	B0 = (float) (e0 * row.invArea);
+	B1 = (float) (e1 * row.invArea);
+	B2 = (float) (e2 * row.invArea);
+	return true;
+}
+
+// z at a pixel from its barycentric coordinates
+inline float RasterZ(const RasterRow &row, float B0, float B1, float B2) {
+	return row.z0 * B0 + row.z1 * B1 + row.z2 * B2;
+}
+
+#if SIMD_X86
+
+// one edge function at 2 pixels: clears the bits of outside pixels in inside,
+// and returns the barycentric coordinates in the low 2 floats
+inline __m128 RasterEdge2(double E, double A, double bias, double invArea, __m128d xs, int &inside) {
+	const __m128d e = _mm_add_pd(_mm_set1_pd(E), _mm_mul_pd(xs, _mm_set1_pd(A)));
+	inside &= _mm_movemask_pd(_mm_cmpge_pd(_mm_add_pd(e, _mm_set1_pd(bias)), _mm_setzero_pd()));
+	return _mm_cvtpd_ps(_mm_mul_pd(e, _mm_set1_pd(invArea)));
+}
+
+// tests the 4 pixels starting at x, whose z values are at zb. the ones inside the triangle and
+// in front of the z buffer get their z written, and are returned as a bit mask with bit i for pixel x + i
+inline int RasterTest4(const RasterRow &row, int x, float *zb) {
+	const __m128d lo = _mm_add_pd(_mm_set1_pd(x), _mm_setr_pd(0, 1));
+	const __m128d hi = _mm_add_pd(lo, _mm_set1_pd(2));
+
+	int insideLo = 3, insideHi = 3;
+	const __m128 B0 = _mm_movelh_ps(
+		RasterEdge2(row.E0, row.A0, row.bias0, row.invArea, lo, insideLo),
+		RasterEdge2(row.E0, row.A0, row.bias0, row.invArea, hi, insideHi));
+	const __m128 B1 = _mm_movelh_ps(
+		RasterEdge2(row.E1, row.A1, row.bias1, row.invArea, lo, insideLo),
+		RasterEdge2(row.E1, row.A1, row.bias1, row.invArea, hi, insideHi));
+	const __m128 B2 = _mm_movelh_ps(
+		RasterEdge2(row.E2, row.A2, row.bias2, row.invArea, lo, insideLo),
+		RasterEdge2(row.E2, row.A2, row.bias2, row.invArea, hi, insideHi));
+
+	const int inside = insideLo | (insideHi << 2);
+	if (inside == 0) return 0;
+
+	const __m128 z = _mm_add_ps(
+		_mm_add_ps(_mm_mul_ps(_mm_set1_ps(row.z0), B0), _mm_mul_ps(_mm_set1_ps(row.z1), B1)),
+		_mm_mul_ps(_mm_set1_ps(row.z2), B2)
+	);
+
+	const __m128 old = _mm_loadu_ps(zb);
+	const int mask = inside & _mm_movemask_ps(_mm_cmpgt_ps(z, old));
+	if (mask == 0) return 0;
+
+	// SSE2 has no blend, so expand the mask back into lanes
+	const __m128i bits = _mm_setr_epi32(1, 2, 4, 8);
+	const __m128 lanes = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(mask), bits), bits));
+	_mm_storeu_ps(zb, _mm_or_ps(_mm_and_ps(lanes, z), _mm_andnot_ps(lanes, old)));
+	return mask;
+}
+
+// RasterEdge2 for 4 pixels
+TARGET_AVX2 inline __m128 RasterEdge4(double E, double A, double bias, double invArea, __m256d xs, int &inside) {
+	const __m256d e = _mm256_add_pd(_mm256_set1_pd(E), _mm256_mul_pd(xs, _mm256_set1_pd(A)));
+	inside &= _mm256_movemask_pd(_mm256_cmp_pd(_mm256_add_pd(e, _mm256_set1_pd(bias)), _mm256_setzero_pd(), _CMP_GE_OQ));
+	return _mm256_cvtpd_ps(_mm256_mul_pd(e, _mm256_set1_pd(invArea)));
+}
+
+// two halves into one register
+TARGET_AVX2 inline __m256 RasterJoin(__m128 lo, __m128 hi) {
+	return _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+}
+
+// same as RasterTest4 for 8 pixels. only call it when GetSimdLevel() is SIMD_AVX2
+TARGET_AVX2 inline int RasterTest8(const RasterRow &row, int x, float *zb) {
+	const __m256d lo = _mm256_add_pd(_mm256_set1_pd(x), _mm256_setr_pd(0, 1, 2, 3));
+	const __m256d hi = _mm256_add_pd(lo, _mm256_set1_pd(4));
+
+	int insideLo = 15, insideHi = 15;
+	const __m256 B0 = RasterJoin(
+		RasterEdge4(row.E0, row.A0, row.bias0, row.invArea, lo, insideLo),
+		RasterEdge4(row.E0, row.A0, row.bias0, row.invArea, hi, insideHi));
+	const __m256 B1 = RasterJoin(
+		RasterEdge4(row.E1, row.A1, row.bias1, row.invArea, lo, insideLo),
+		RasterEdge4(row.E1, row.A1, row.bias1, row.invArea, hi, insideHi));
+	const __m256 B2 = RasterJoin(
+		RasterEdge4(row.E2, row.A2, row.bias2, row.invArea, lo, insideLo),
+		RasterEdge4(row.E2, row.A2, row.bias2, row.invArea, hi, insideHi));
+
+	const int inside = insideLo | (insideHi << 4);
+	if (inside == 0) return 0;
+
+	const __m256 z = _mm256_add_ps(
+		_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(row.z0), B0), _mm256_mul_ps(_mm256_set1_ps(row.z1), B1)),
+		_mm256_mul_ps(_mm256_set1_ps(row.z2), B2)
+	);
+
+	const __m256 old = _mm256_loadu_ps(zb);
+	const int mask = inside & _mm256_movemask_ps(_mm256_cmp_ps(z, old, _CMP_GT_OQ));
+	if (mask == 0) return 0;
+
+	const __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+	const __m256 lanes = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(mask), bits), bits));
+	_mm256_storeu_ps(zb, _mm256_blendv_ps(old, z, lanes));
+	return mask;
+}
+
+#endif // SIMD_X86
+
+#endif // RASTER_SIMD_HPP
@@ -1,5 +1,6 @@
 #include "envmapping.hpp"
 #include "cube_map.hpp"
+#include "imgui.h"
 #include "ppcamera.hpp"
 #include "scene.hpp"
 #include "window.hpp"
@@ -20,7 +21,10 @@ EnvironmentMappingScene::EnvironmentMappingScene(WindowGroup &group):
 	map(sides),
 	camera(wind->w, wind->h, 60.0f)
 {
+	depthPrepass = false;
+
 	obj.Load("geometry/teapot57K.bin");
+	obj.OptimizeVertexCache();
 	obj.TranslateTo(V3(0, 0, -120));
 
 	group.ClaimForImgui(*wind);
@@ -69,6 +73,28 @@ void EnvironmentMappingScene::Update(void) {
 }
 
 void EnvironmentMappingScene::Render(void) {
-	wind->fb.Clear(map, camera);
+	if (depthPrepass) {
+		// find out where the teapot is first and skip the cube map lookups there
+		wind->fb.Clear(0);
+		obj.DrawDepthOnly(wind->fb, camera);
+		wind->fb.Clear(map, camera, true);
+	} else {
+		wind->fb.Clear(map, camera);
+	}
 	obj.DrawFilledEnvMap(wind->fb, camera, map);
+
+	ImGui::SetNextWindowPos(ImVec2(0, 0), ImGuiCond_FirstUseEver);
+	ImGui::SetNextWindowSize(ImVec2(wind->w/4.0f, wind->h/4.0f), ImGuiCond_FirstUseEver);
+	// default should be collapsed
+	ImGui::SetNextWindowCollapsed(true, ImGuiCond_FirstUseEver);
+
+	if (!ImGui::Begin("debug-gui", nullptr, 0)) {
+		ImGui::End();
+		return;
+	}
+
+	ImGui::Text("dt: %.3f, fps: %.1f", wind->deltaTime, 1.0 / wind->deltaTime);
+	ImGui::Checkbox("depth prepass", &depthPrepass);
+
+	ImGui::End();
 }
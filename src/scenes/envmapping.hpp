@@ -14,6 +14,9 @@ struct EnvironmentMappingScene: public Scene {
 	CubeMap map;
 	Mesh obj;
 	PPCamera camera;
+	// draw the teapot's depth first and skip the cube map lookups it covers. it costs a
+	// geometry pass, which is more than the lookups save at this size, so it starts off
+	bool depthPrepass;
 
 	EnvironmentMappingScene(WindowGroup &group);
 
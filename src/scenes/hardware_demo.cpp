@@ -20,11 +20,9 @@ HardwareDemoScene::HardwareDemoScene(WindowGroup &g):
 	wireTexMesh.Load2DPlane(50, 50);
 	wireTexMesh.TranslateTo(V3(50.0f, -25.0f, -300.0f));
 
-	filledColorMesh.Load("geometry/teapot1K.bin");
-	filledColorMesh.TranslateTo(V3(-50.0f, 0, -150.0f));
-
-	wireColorMesh.Load("geometry/teapot1K.bin");
-	wireColorMesh.TranslateTo(V3(50.0f, 0, -150.0f));
+	teapot.Load("geometry/teapot1K.bin");
+	filledTeapot = Transform::Translation(V3(-50.0f, 0, -150.0f) - teapot.GetCenter());
+	wireTeapot = Transform::Translation(V3(50.0f, 0, -150.0f) - teapot.GetCenter());
 
 	floorMesh.LoadPlane(V3(0, -25.0f, -100.0f), V3(200, 0, 200), V3(1, 0, 1));
 
@@ -137,8 +135,8 @@ void HardwareDemoScene::Render(void) {
 	hwClear(V3());
 	hwDrawMesh(filledTexMesh, true, texId);
 	hwDrawMesh(wireTexMesh, false, texId);
-	hwDrawMesh(filledColorMesh, true);
-	hwDrawMesh(wireColorMesh, false);
+	hwDrawMesh(teapot, filledTeapot, true);
+	hwDrawMesh(teapot, wireTeapot, false);
 	hwDrawMesh(floorMesh, true);
 
 	constexpr static int scale = 3;
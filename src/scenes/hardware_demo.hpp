@@ -12,7 +12,10 @@
 struct HardwareDemoScene: public Scene {
 
 	std::shared_ptr<Window> wind;
-	Mesh filledTexMesh, wireTexMesh, filledColorMesh, wireColorMesh, floorMesh;
+	Mesh filledTexMesh, wireTexMesh, floorMesh;
+	// one teapot, drawn twice
+	Mesh teapot;
+	Transform filledTeapot, wireTeapot;
 	Mesh uiMesh;
 	PPCamera camera;
 	HWTexID texId, uiTex;
@@ -2,12 +2,15 @@
 #include "imgui.h"
 #include "math/v3.hpp"
 #include "scene.hpp"
+#include "thread_pool.hpp"
 
 ShadowScene::ShadowScene(WindowGroup &g):
 	Scene(g),
 	wind(g.AddWindow(640, 480, "shadow-scene")),
 	userCamera(wind->w, wind->h, 60.0f),
 	lightCamera(SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, 90.0f),
+	shadowCache(SHADOW_MAP_SIZE),
+	cubeShadowMap(SHADOW_MAP_SIZE),
 	lightWindow(g.AddWindow(SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, "light-buffer"))
 {
 
@@ -16,14 +19,19 @@ ShadowScene::ShadowScene(WindowGroup &g):
 	lookAtPoint = V3(0, 10, -100);
 	teapotPosition = V3(10, 2, -90);
 	teapotAngle = lastAngle = 0.0f;
+	deferred = false;
+	shadowCache.sampler.filter = ShadowSampler::FILTER_PCF_EDGES;
+	shadowCache.sampler.kernel = 3;
+	omnidirectional = false;
+	cubeDrawn = false;
 
 	ground.LoadPlane(V3(0, -25, -150), V3(100, 1, 200), V3(0.5, 0.5, 0.5));
 
 	caster.Load("geometry/teapot57K.bin");
+	caster.OptimizeVertexCache();
 	caster.TranslateTo(teapotPosition);
 
 	lightCamera.Pose(V3(0, 50, -10), lookAtPoint, V3(0, 1, 0));
-	UpdateLightBuffer();
 
 	wind->MoveTo(100, 100);
 	lightWindow->MoveTo(wind->w + 150, 100);
@@ -68,10 +76,29 @@ void ShadowScene::Update() {
 }
 
 void ShadowScene::Render() {
+	// costs nothing unless the light or a caster moved
+	UpdateLightBuffer();
+
 	wind->fb.Clear(0);
 
-	ground.DrawFilledPointLight(wind->fb, userCamera, lightCamera, lightWindow->fb, ka, specularIntensity);
-	caster.DrawFilledPointLight(wind->fb, userCamera, lightCamera, lightWindow->fb, ka, specularIntensity);
+	const ShadowSampler &shadowSampler = shadowCache.sampler;
+	cubeShadowMap.SetFilter(shadowSampler.filter, shadowSampler.kernel);
+
+	if (deferred) {
+		gbuffer.Reset(wind->fb);
+		ground.DrawVisibility(wind->fb, gbuffer, userCamera);
+		caster.DrawVisibility(wind->fb, gbuffer, userCamera);
+		if (omnidirectional)
+			Mesh::ShadeDeferred(wind->fb, gbuffer, userCamera, cubeShadowMap, ka, specularIntensity);
+		else
+			Mesh::ShadeDeferred(wind->fb, gbuffer, userCamera, lightCamera, shadowSampler, ka, specularIntensity);
+	} else if (omnidirectional) {
+		ground.DrawFilledPointLight(wind->fb, userCamera, cubeShadowMap, ka, specularIntensity);
+		caster.DrawFilledPointLight(wind->fb, userCamera, cubeShadowMap, ka, specularIntensity);
+	} else {
+		ground.DrawFilledPointLight(wind->fb, userCamera, lightCamera, shadowSampler, ka, specularIntensity);
+		caster.DrawFilledPointLight(wind->fb, userCamera, lightCamera, shadowSampler, ka, specularIntensity);
+	}
 	wind->fb.DrawCamera(userCamera, lightCamera);
 
 	ImGui::SetNextWindowPos(ImVec2(0, 0), ImGuiCond_FirstUseEver);
@@ -94,22 +121,49 @@ void ShadowScene::Render() {
 		userCamera.Pose(lightCamera.C, lookAtPoint, V3(0, 1, 0));
 	}
 
-	bool didUpdate = false;
+	int threadCount = (int) ThreadPool::Global().GetThreadCount();
+	if (ImGui::SliderInt("render threads", &threadCount, 1, (int) std::max(1u, std::thread::hardware_concurrency()))) {
+		ThreadPool::Global().SetThreadCount(threadCount);
+	}
+
+	ImGui::Checkbox("deferred shading", &deferred);
 
-	didUpdate |= ImGui::DragFloat3("light position", lightCamera.C);
-	didUpdate |= ImGui::DragFloat3("teapot position", teapotPosition);
-	didUpdate |= ImGui::DragFloat("teapotAngle", &teapotAngle, 1.0f, -180.0f, 180.0f);
+	static const char *shadowFilterNames[] = {"hard", "pcf", "pcf edges only"};
+	ImGui::ListBox("shadow filter", (int*) &shadowCache.sampler.filter, shadowFilterNames, sizeof(shadowFilterNames) / sizeof(*shadowFilterNames));
+	ImGui::SliderInt("shadow filter size", &shadowCache.sampler.kernel, 2, ShadowSampler::MAX_KERNEL);
+	ImGui::Text("shadow map redraws: %zu full, %zu partial", shadowCache.fullRedraws, shadowCache.partialRedraws);
 
-	if (didUpdate) UpdateLightBuffer();
+	bool tiled = wind->fb.layout == FrameBuffer::LAYOUT_TILED;
+	if (ImGui::Checkbox("tiled frame buffer", &tiled)) {
+		wind->fb.SetLayout(tiled ? FrameBuffer::LAYOUT_TILED : FrameBuffer::LAYOUT_LINEAR);
+	}
+	ImGui::Checkbox("cull teapot back faces", &caster.cullBackFaces);
+
+	const Mesh::CullStats &stats = caster.cullStats;
+	ImGui::Text("teapot triangles: %zu drawn, %zu back facing, %zu off screen, %zu behind camera",
+		stats.drawn, stats.backFacing, stats.offScreen, stats.behindCamera);
+	ImGui::Text("clipped triangles: %zu teapot, %zu ground", stats.clipped, ground.cullStats.clipped);
+
+	// the shadow maps pick up changes from these on the next frame
+	ImGui::Checkbox("omnidirectional shadows", &omnidirectional);
+
+	ImGui::DragFloat3("light position", lightCamera.C);
+	ImGui::DragFloat3("teapot position", teapotPosition);
+	ImGui::DragFloat("teapotAngle", &teapotAngle, 1.0f, -180.0f, 180.0f);
 
 	ImGui::End();
 }
 
 void ShadowScene::UpdateLightBuffer() {
-	lightWindow->fb.Clear(0);
-
-	ground.DrawFilledNoLighting(lightWindow->fb, lightCamera);
-	caster.DrawFilledNoLighting(lightWindow->fb, lightCamera);
+	if (shadowCache.Update(lightCamera, { &ground, &caster })) {
+		lightWindow->fb.DrawZBuffer(shadowCache.map);
+		cubeDrawn = false;
+	}
 
-	lightWindow->fb.DrawZBuffer();
+	// anything that changed the single map changes the cube too
+	if (omnidirectional && !cubeDrawn) {
+		cubeShadowMap.SetCenter(lightCamera.C);
+		cubeShadowMap.Render({ &ground, &caster });
+		cubeDrawn = true;
+	}
 }
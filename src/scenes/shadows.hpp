@@ -5,6 +5,8 @@
 #include "window.hpp"
 #include "ppcamera.hpp"
 #include "mesh.hpp"
+#include "cube_shadow_map.hpp"
+#include "shadow_map_cache.hpp"
 #include <memory>
 
 constexpr int SHADOW_MAP_SIZE = 512;
@@ -15,6 +17,14 @@ struct ShadowScene: public Scene {
 	PPCamera userCamera;
 
 	PPCamera lightCamera;
+	// depth from the light, only redrawn when the light or a caster moves. lightWindow
+	// just shows it, and its sampler has the filter picked in the gui
+	ShadowMapCache shadowCache;
+	// shadows all around the light instead of only inside lightCamera's view
+	bool omnidirectional;
+	CubeShadowMap cubeShadowMap;
+	// false when cubeShadowMap is out of date
+	bool cubeDrawn;
 	std::shared_ptr<Window> lightWindow;
 	float ka;
 	float specularIntensity;
@@ -24,6 +34,10 @@ struct ShadowScene: public Scene {
 	V3 teapotPosition;
 	float teapotAngle, lastAngle;
 
+	// shade each visible pixel once after a visibility pass, instead of every fragment
+	bool deferred;
+	GBuffer gbuffer;
+
 	ShadowScene(WindowGroup &group);
 
 	void Update() override;
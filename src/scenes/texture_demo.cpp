@@ -111,7 +111,7 @@ void TextureDemoScene::Render() {
 	static const char *tileModeNames[] = {"repeat", "mirror"};
 	ImGui::ListBox("tiling mode", (int*) &tilingMode, tileModeNames, sizeof(tileModeNames) / sizeof(*tileModeNames));
 
-	static const char *filterModeNames[] = {"nearest neighbor", "bilinear"};
+	static const char *filterModeNames[] = {"nearest neighbor", "bilinear", "trilinear"};
 	ImGui::ListBox("filter mode", (int*) &filterMode, filterModeNames, sizeof(filterModeNames) / sizeof(*filterModeNames));
 
 	ImGui::End();
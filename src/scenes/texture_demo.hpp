@@ -5,6 +5,7 @@
 #include "mesh.hpp"
 #include "window.hpp"
 #include "scene.hpp"
+#include "texture.hpp"
 #include "ppcamera.hpp"
 #include <memory>
 #include <vector>
@@ -14,15 +15,16 @@ struct TextureDemoScene: public Scene {
 	std::shared_ptr<Window> wind;
 	PPCamera camera;
 	Mesh texturedMeshes[4];
-	FrameBuffer texes[4];
+	Texture texes[4];
 
 	enum: int {
 		TILING_REPEAT = 0,
 		TILING_MIRROR = 1,
 	} tilingMode;
 	enum: int {
-		FILTER_NEAREST = 0,
-		FILTER_BILINEAR = 1,
+		FILTER_NEAREST = Texture::FILTER_NEAREST,
+		FILTER_BILINEAR = Texture::FILTER_BILINEAR,
+		FILTER_TRILINEAR = Texture::FILTER_TRILINEAR,
 	} filterMode;
 	float timer;
 	unsigned frame;
@@ -0,0 +1,122 @@
+#include "shadow_map_cache.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+static inline bool SameVector(const V3 &a, const V3 &b) {
+	return a.x() == b.x() && a.y() == b.y() && a.z() == b.z();
+}
+
+static bool SameTransform(const Transform &a, const Transform &b) {
+	return SameVector(a.linear[0], b.linear[0]) && SameVector(a.linear[1], b.linear[1]) &&
+		SameVector(a.linear[2], b.linear[2]) && SameVector(a.translation, b.translation);
+}
+
+// a map drawn from one camera is good for the other
+static bool SamePose(const PPCamera &a, const PPCamera &b) {
+	return a.w == b.w && a.h == b.h &&
+		SameVector(a.C, b.C) && SameVector(a.a, b.a) && SameVector(a.b, b.b) && SameVector(a.c, b.c);
+}
+
+// the smallest rect holding both
+static ScreenRect Union(const ScreenRect &a, const ScreenRect &b) {
+	if (a.Empty()) return b;
+	if (b.Empty()) return a;
+	return ScreenRect{
+		std::min(a.left, b.left), std::min(a.top, b.top),
+		std::max(a.right, b.right), std::max(a.bottom, b.bottom)
+	};
+}
+
+ShadowMapCache::ShadowMapCache(int size):
+	map(size, size), fullRedraws(0), partialRedraws(0), valid(false) {}
+
+ScreenRect ShadowMapCache::CoveredRect(const Mesh &mesh) const {
+	if (mesh.vertexCount == 0) return ScreenRect{0, 0, -1, -1};
+
+	const AABB box = mesh.GetAABB();
+
+	// the box's corners, placed the way WorldVertex places the vertices, bound its
+	// projection, unless one is behind the light
+	float left = INFINITY, top = INFINITY, right = -INFINITY, bottom = -INFINITY;
+	for (int corner = 0; corner < 8; corner++) {
+		V3 P(
+			corner & 1 ? box.max.x() : box.min.x(),
+			corner & 2 ? box.max.y() : box.min.y(),
+			corner & 4 ? box.max.z() : box.min.z()
+		);
+		if (mesh.drawModel) P = mesh.drawModel->ApplyPoint(P);
+
+		V3 p;
+		if (!light.ProjectPoint(P, p)) return map.Bounds();
+
+		left = std::min(left, p.x());
+		right = std::max(right, p.x());
+		top = std::min(top, p.y());
+		bottom = std::max(bottom, p.y());
+	}
+
+	// a texel of slack for rounding, far off the map clamps to its edge
+	const float limit = (float) std::max(map.w, map.h) + 1.0f;
+	const ScreenRect rect = {
+		(int) floorf(std::clamp(left, -limit, limit)) - 1,
+		(int) floorf(std::clamp(top, -limit, limit)) - 1,
+		(int) ceilf(std::clamp(right, -limit, limit)) + 1,
+		(int) ceilf(std::clamp(bottom, -limit, limit)) + 1,
+	};
+	return rect.Intersect(map.Bounds());
+}
+
+ShadowMapCache::Caster ShadowMapCache::Drawn(const Mesh &mesh) const {
+	return Caster{&mesh, mesh.version, mesh.drawModel != nullptr,
+		mesh.drawModel ? *mesh.drawModel : Transform(), CoveredRect(mesh)};
+}
+
+void ShadowMapCache::Redraw(const std::vector<Mesh *> &casters) {
+	map.Clear(0);
+
+	// only depth matters for the shadow test
+	for (Mesh *mesh: casters) mesh->DrawDepthOnly(map, light);
+
+	sampler.Prepare(map);
+	fullRedraws++;
+}
+
+bool ShadowMapCache::Update(const PPCamera &newLight, const std::vector<Mesh *> &casters) {
+	bool sameCasters = drawn.size() == casters.size();
+	for (size_t i = 0; sameCasters && i < casters.size(); i++) sameCasters = drawn[i].mesh == casters[i];
+
+	if (!valid || !sameCasters || !SamePose(light, newLight)) {
+		light = newLight;
+		Redraw(casters);
+
+		drawn.resize(casters.size());
+		for (size_t i = 0; i < casters.size(); i++) drawn[i] = Drawn(*casters[i]);
+
+		valid = true;
+		return true;
+	}
+
+	// the texels that might look different: wherever a caster that changed was or is now
+	ScreenRect dirty = {0, 0, -1, -1};
+	for (Caster &caster: drawn) {
+		const Mesh &mesh = *caster.mesh;
+		const bool placed = mesh.drawModel != nullptr;
+		if (mesh.version == caster.version && placed == caster.placed &&
+			(!placed || SameTransform(*mesh.drawModel, caster.model))) continue;
+
+		const Caster now = Drawn(mesh);
+		dirty = Union(dirty, Union(caster.rect, now.rect));
+		caster = now;
+	}
+
+	if (dirty.Empty()) return false;
+
+	// every caster can reach into the dirty texels, but only those get cleared and drawn
+	map.ClearZ(dirty);
+	for (Mesh *mesh: casters) mesh->DrawDepthOnly(map, light, dirty);
+
+	sampler.Prepare(map, dirty);
+	partialRedraws++;
+	return true;
+}
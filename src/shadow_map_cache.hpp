@@ -0,0 +1,59 @@
+#ifndef SHADOW_MAP_CACHE_HPP
+#define SHADOW_MAP_CACHE_HPP
+
+#include "frame_buffer.hpp"
+#include "mesh.hpp"
+#include "ppcamera.hpp"
+#include "shadow_sampler.hpp"
+#include "math/transform.hpp"
+
+#include <cstdint>
+#include <vector>
+
+// a shadow map that is only redrawn when something it shows changed. it remembers the
+// light's pose and each caster's version (see Mesh::MarkChanged) and drawModel: a new pose
+// or a different list of casters redraws everything, a caster that changed or was placed
+// differently only redraws the texels under where it was and where it is now, and if
+// nothing changed drawing costs nothing at all. casters are drawn where their drawModel
+// puts them when Update is called, once each
+struct ShadowMapCache {
+	DepthBuffer map;
+	// map ready for shadow tests, set its filter directly
+	ShadowSampler sampler;
+
+	// how often Update redrew the whole map and only part of it
+	size_t fullRedraws, partialRedraws;
+
+	// a size x size map
+	ShadowMapCache(int size);
+
+	// bring the map up to date with casters drawn from light, whose size has to match
+	// the map's. true if anything was redrawn
+	bool Update(const PPCamera &light, const std::vector<Mesh *> &casters);
+
+	// redraw everything on the next Update
+	inline void Invalidate(void) { valid = false; }
+
+private:
+	struct Caster {
+		const Mesh *mesh;
+		uint64_t version;
+		// the mesh's drawModel when it was last drawn, if it had one
+		bool placed;
+		Transform model;
+		// the texels the mesh's bounding box covered when it was last drawn
+		ScreenRect rect;
+	};
+
+	bool valid;
+	PPCamera light;
+	std::vector<Caster> drawn;
+
+	// the texels of map that mesh's bounding box covers from light, placed by its drawModel
+	ScreenRect CoveredRect(const Mesh &mesh) const;
+	// remember how mesh is drawn now
+	Caster Drawn(const Mesh &mesh) const;
+	void Redraw(const std::vector<Mesh *> &casters);
+};
+
+#endif // SHADOW_MAP_CACHE_HPP
@@ -0,0 +1,182 @@
+#include "shadow_sampler.hpp"
+#include "simd.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+ShadowSampler::ShadowSampler():
+	filter(FILTER_NEAREST), kernel(3), w(0), h(0), stride(0), coarseW(0), coarseH(0) {}
+
+void ShadowSampler::Prepare(const FrameBuffer &map) {
+	w = map.w;
+	h = map.h;
+	stride = w + 2 * BORDER;
+	depth.assign((size_t) stride * (h + 2 * BORDER), 0.0f);
+
+	coarseW = (w + COARSE_TILE - 1) / COARSE_TILE;
+	coarseH = (h + COARSE_TILE - 1) / COARSE_TILE;
+	blockMin.resize((size_t) coarseW * coarseH);
+	blockMax.resize(blockMin.size());
+	coarseMin.resize(blockMin.size());
+	coarseMax.resize(blockMin.size());
+
+	if (w > 0 && h > 0) Update(map, map.Bounds());
+}
+
+void ShadowSampler::Prepare(const FrameBuffer &map, const ScreenRect &rect) {
+	if (map.w != w || map.h != h) {
+		Prepare(map);
+		return;
+	}
+
+	const ScreenRect r = rect.Intersect(map.Bounds());
+	if (!r.Empty()) Update(map, r);
+}
+
+void ShadowSampler::Update(const FrameBuffer &map, const ScreenRect &rect) {
+	map.ResolveClear();
+
+	for (int y = rect.top; y <= rect.bottom; y++) {
+		float *row = &depth[(size_t) (y + BORDER) * stride + BORDER];
+		for (int x = rect.left; x <= rect.right; x++) row[x] = map.zb[map.Index(x, y)];
+	}
+
+	// each block on its own. a block hanging off the map reads the border, which is
+	// what a kernel reaching past the map would read too
+	const int left = rect.left / COARSE_TILE, right = rect.right / COARSE_TILE;
+	const int top = rect.top / COARSE_TILE, bottom = rect.bottom / COARSE_TILE;
+
+	for (int by = top; by <= bottom; by++) {
+		for (int bx = left; bx <= right; bx++) {
+			float lo = *Texel(bx * COARSE_TILE, by * COARSE_TILE), hi = lo;
+			for (int y = 0; y < COARSE_TILE; y++) {
+				const float *row = Texel(bx * COARSE_TILE, by * COARSE_TILE + y);
+				for (int x = 0; x < COARSE_TILE; x++) {
+					lo = std::min(lo, row[x]);
+					hi = std::max(hi, row[x]);
+				}
+			}
+			blockMin[bx + by * coarseW] = lo;
+			blockMax[bx + by * coarseW] = hi;
+		}
+	}
+
+	// then with their neighbours, blocks off the map are empty. the blocks
+	// next to the ones that changed see them too
+	for (int by = std::max(top - 1, 0); by <= std::min(bottom + 1, coarseH - 1); by++) {
+		for (int bx = std::max(left - 1, 0); bx <= std::min(right + 1, coarseW - 1); bx++) {
+			float lo = blockMin[bx + by * coarseW], hi = blockMax[bx + by * coarseW];
+			for (int y = by - 1; y <= by + 1; y++) {
+				for (int x = bx - 1; x <= bx + 1; x++) {
+					if (x < 0 || y < 0 || x >= coarseW || y >= coarseH) {
+						lo = std::min(lo, 0.0f);
+						continue;
+					}
+					lo = std::min(lo, blockMin[x + y * coarseW]);
+					hi = std::max(hi, blockMax[x + y * coarseW]);
+				}
+			}
+			coarseMin[bx + by * coarseW] = lo;
+			coarseMax[bx + by * coarseW] = hi;
+		}
+	}
+}
+
+float ShadowSampler::Lit(float u, float v, float z, float epsilon) const {
+	if (filter == FILTER_NEAREST) {
+		// off the map is empty
+		float d = 0.0f;
+		if (u > -1.0f && v > -1.0f && u < w && v < h) d = *Texel((int) u, (int) v);
+		return z >= d - epsilon ? 1.0f : 0.0f;
+	}
+
+	// if every texel the kernel could read agrees, so does the kernel
+	if (filter == FILTER_PCF_EDGES && u >= 0.0f && v >= 0.0f && u < w && v < h) {
+		const size_t block = (int) u / COARSE_TILE + ((int) v / COARSE_TILE) * coarseW;
+		if (z >= coarseMax[block] - epsilon) return 1.0f;
+		if (!(z >= coarseMin[block] - epsilon)) return 0.0f;
+	}
+
+	return Filtered(u, v, z, epsilon);
+}
+
+// the kernel x kernel texels starting at row, counting the ones that light z.
+// every version does the same float operations, so they agree exactly
+
+static int CountLit(const float *row, int stride, int kernel, float z, float epsilon) {
+	int lit = 0;
+	for (int y = 0; y < kernel; y++, row += stride) {
+		for (int x = 0; x < kernel; x++) lit += z >= row[x] - epsilon;
+	}
+	return lit;
+}
+
+#if SIMD_X86
+
+// loading 8 from LANE_MASKS + 8 - n gives n lanes of -1 and the rest 0
+alignas(32) static const int32_t LANE_MASKS[16] = {
+	-1, -1, -1, -1, -1, -1, -1, -1,
+	0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+static inline int Sum4(__m128i v) {
+	alignas(16) int32_t lanes[4];
+	_mm_store_si128((__m128i *) lanes, v);
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+// each kernel row as two halves of 4
+static int CountLit4(const float *row, int stride, int kernel, float z, float epsilon) {
+	const __m128 zs = _mm_set1_ps(z), eps = _mm_set1_ps(epsilon);
+	const __m128 maskLo = _mm_castsi128_ps(_mm_loadu_si128((const __m128i *) (LANE_MASKS + 8 - kernel)));
+	const __m128 maskHi = _mm_castsi128_ps(_mm_loadu_si128((const __m128i *) (LANE_MASKS + 12 - kernel)));
+
+	// lit lanes compare to -1, so subtracting them counts up
+	__m128i count = _mm_setzero_si128();
+	for (int y = 0; y < kernel; y++, row += stride) {
+		const __m128 lo = _mm_and_ps(_mm_cmpge_ps(zs, _mm_sub_ps(_mm_loadu_ps(row), eps)), maskLo);
+		const __m128 hi = _mm_and_ps(_mm_cmpge_ps(zs, _mm_sub_ps(_mm_loadu_ps(row + 4), eps)), maskHi);
+		count = _mm_sub_epi32(count, _mm_add_epi32(_mm_castps_si128(lo), _mm_castps_si128(hi)));
+	}
+	return Sum4(count);
+}
+
+// each kernel row in one go
+TARGET_AVX2 static int CountLit8(const float *row, int stride, int kernel, float z, float epsilon) {
+	const __m256 zs = _mm256_set1_ps(z), eps = _mm256_set1_ps(epsilon);
+	const __m256 mask = _mm256_castsi256_ps(_mm256_loadu_si256((const __m256i *) (LANE_MASKS + 8 - kernel)));
+
+	__m256i count = _mm256_setzero_si256();
+	for (int y = 0; y < kernel; y++, row += stride) {
+		const __m256 lit = _mm256_and_ps(_mm256_cmp_ps(zs, _mm256_sub_ps(_mm256_loadu_ps(row), eps), _CMP_GE_OQ), mask);
+		count = _mm256_sub_epi32(count, _mm256_castps_si256(lit));
+	}
+	return Sum4(_mm_add_epi32(_mm256_castsi256_si128(count), _mm256_extracti128_si256(count, 1)));
+}
+
+#endif
+
+float ShadowSampler::Filtered(float u, float v, float z, float epsilon) const {
+	const int k = std::clamp(kernel, 2, MAX_KERNEL);
+
+	// odd kernels are centered on the sample's texel, even ones on the texel corner nearest it
+	const float x = u - (k - 1) * 0.5f, y = v - (k - 1) * 0.5f;
+
+	// nothing but empty texels, this also catches NaN
+	if (!(x > -k && y > -k && x < w && y < h)) return z >= 0.0f - epsilon ? 1.0f : 0.0f;
+
+	const float *row = Texel((int) floorf(x), (int) floorf(y));
+
+	int lit;
+#if SIMD_X86
+	const SimdLevel simd = GetSimdLevel();
+	if (simd >= SIMD_AVX2) lit = CountLit8(row, stride, k, z, epsilon);
+	else if (simd >= SIMD_SSE) lit = CountLit4(row, stride, k, z, epsilon);
+	else lit = CountLit(row, stride, k, z, epsilon);
+#else
+	lit = CountLit(row, stride, k, z, epsilon);
+#endif
+
+	return lit / (float) (k * k);
+}
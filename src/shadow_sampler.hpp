@@ -0,0 +1,70 @@
+#ifndef SHADOW_SAMPLER_HPP
+#define SHADOW_SAMPLER_HPP
+
+#include "frame_buffer.hpp"
+
+#include <vector>
+
+// shadow tests against a light's depth buffer, optionally with percentage closer filtering:
+// the fraction of the texels around the sample that light the point, which softens the edges.
+// Prepare copies the depth into a row major array with an empty border around it, so a
+// kernel row is one unaligned load wherever the sample lands, even off the edge of the map
+struct ShadowSampler {
+	enum Filter: int {
+		// one texel, hard edges
+		FILTER_NEAREST = 0,
+		// kernel x kernel texels around the sample
+		FILTER_PCF = 1,
+		// the same result as FILTER_PCF, but pixels the coarse min/max z shows are fully
+		// lit or fully shadowed skip the kernel, so only ones near a shadow edge pay for it
+		FILTER_PCF_EDGES = 2,
+	};
+
+	// widest kernel, a kernel row has to fit in 8 floats
+	static constexpr int MAX_KERNEL = 7;
+
+	Filter filter;
+	// kernel width in texels for the PCF filters, 2 to MAX_KERNEL
+	int kernel;
+
+	// size of the map, in texels
+	int w, h;
+
+	ShadowSampler();
+
+	// copy map's depth, call again every time it is redrawn
+	void Prepare(const FrameBuffer &map);
+	// copy only the texels in rect, after redrawing just that part of the same map
+	void Prepare(const FrameBuffer &map, const ScreenRect &rect);
+
+	// how much light reaches a point at shadow map u, v with 1/w z. 0 is in shadow, 1 is lit.
+	// a texel lights it if z >= that texel's z - epsilon, the map's empty texels always do
+	float Lit(float u, float v, float z, float epsilon) const;
+
+private:
+	// texels of 0 around the map, enough for the 8 wide rows of a kernel hanging off any edge
+	static constexpr int BORDER = 8;
+	int stride;
+	std::vector<float> depth;
+
+	// for each COARSE_TILE x COARSE_TILE block of the map, the farthest and nearest z
+	// in it and the blocks around it: everything a kernel centered in it could read
+	static constexpr int COARSE_TILE = 8;
+	static_assert(MAX_KERNEL / 2 < COARSE_TILE, "kernels only reach into the next block");
+	int coarseW, coarseH;
+	std::vector<float> coarseMin, coarseMax;
+	// the same for each block on its own, kept for redrawing part of the map
+	std::vector<float> blockMin, blockMax;
+
+	// texel x, y, which may be in the border
+	inline const float *Texel(int x, int y) const {
+		return &depth[(size_t) (y + BORDER) * stride + x + BORDER];
+	}
+
+	// copy rect, which has to be inside the map, and recompute the blocks it touches
+	void Update(const FrameBuffer &map, const ScreenRect &rect);
+
+	float Filtered(float u, float v, float z, float epsilon) const;
+};
+
+#endif // SHADOW_SAMPLER_HPP
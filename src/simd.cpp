@@ -0,0 +1,58 @@
+#include "simd.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+
+#if SIMD_X86 && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+SimdLevel SimdSupportedLevel(void) {
+#if SIMD_X86 && (defined(__GNUC__) || defined(__clang__))
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") ? SIMD_AVX2 : SIMD_SSE;
+#elif SIMD_X86 && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) return SIMD_SSE;
+
+	// the os has to save the ymm registers for us too
+	__cpuid(info, 1);
+	const bool osxsave = (info[2] & (1 << 27)) != 0;
+	if (!osxsave || (_xgetbv(0) & 6) != 6) return SIMD_SSE;
+
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) ? SIMD_AVX2 : SIMD_SSE;
+#else
+	return SIMD_SCALAR;
+#endif
+}
+
+static SimdLevel LevelFromEnvironment(void) {
+	const SimdLevel supported = SimdSupportedLevel();
+	const char *env = std::getenv("RENDER_SIMD");
+
+	if (env == nullptr) return supported;
+
+	SimdLevel requested = supported;
+	if (strcmp(env, "scalar") == 0) requested = SIMD_SCALAR;
+	else if (strcmp(env, "sse") == 0) requested = SIMD_SSE;
+	else if (strcmp(env, "avx2") == 0) requested = SIMD_AVX2;
+
+	return requested < supported ? requested : supported;
+}
+
+static std::atomic<SimdLevel> &CurrentLevel(void) {
+	static std::atomic<SimdLevel> level(LevelFromEnvironment());
+	return level;
+}
+
+SimdLevel GetSimdLevel(void) {
+	return CurrentLevel().load(std::memory_order_relaxed);
+}
+
+void SetSimdLevel(SimdLevel level) {
+	const SimdLevel supported = SimdSupportedLevel();
+	CurrentLevel() = level < supported ? level : supported;
+}
@@ -0,0 +1,39 @@
+#ifndef SIMD_HPP
+#define SIMD_HPP
+
+// which SIMD instruction sets the software rasterizer may use
+
+// SSE2 is part of every x86-64 cpu, so it only needs a compile time check.
+// other architectures fall back to plain C++
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIMD_X86 1
+#include <immintrin.h>
+#else
+#define SIMD_X86 0
+#endif
+
+// AVX2 has to be checked at runtime, so functions using it are compiled for it
+// individually instead of for the whole program. MSVC doesn't need this
+#if SIMD_X86 && (defined(__GNUC__) || defined(__clang__))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+enum SimdLevel: int {
+	SIMD_SCALAR = 0,
+	SIMD_SSE = 1,
+	SIMD_AVX2 = 2,
+};
+
+// best level this cpu supports
+SimdLevel SimdSupportedLevel(void);
+
+// level in use. defaults to the best supported one, lowered by the RENDER_SIMD
+// environment variable (scalar, sse or avx2)
+SimdLevel GetSimdLevel(void);
+
+// change the level in use, clamped to what the cpu supports
+void SetSimdLevel(SimdLevel level);
+
+#endif // SIMD_HPP
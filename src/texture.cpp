@@ -0,0 +1,104 @@
+#include "texture.hpp"
+#include "color.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+// texel index i, wrapped into [0, n)
+static inline int Wrap(int i, int n, bool mirror) {
+	if (mirror) {
+		// every other copy is flipped
+		i = ((i % (2 * n)) + 2 * n) % (2 * n);
+		return i < n ? i : 2 * n - 1 - i;
+	}
+
+	return ((i % n) + n) % n;
+}
+
+Texture::Texture() {
+	levels.push_back(std::make_unique<FrameBuffer>(1, 1));
+}
+
+bool Texture::LoadFromTiff(const char *path) {
+	bool ok = levels[0]->LoadFromTiff(path);
+	BuildMips();
+	return ok;
+}
+
+void Texture::BuildMips(void) {
+	levels.resize(1);
+
+	while (levels.back()->w > 1 || levels.back()->h > 1) {
+		const FrameBuffer &src = *levels.back();
+		auto dst = std::make_unique<FrameBuffer>(std::max(1, src.w / 2), std::max(1, src.h / 2));
+
+		// box filter each 2x2 block. odd sizes lose their last row/column
+		for (int v = 0; v < dst->h; v++) {
+			for (int u = 0; u < dst->w; u++) {
+				const int u0 = 2 * u, u1 = std::min(2 * u + 1, src.w - 1);
+				const int v0 = 2 * v, v1 = std::min(2 * v + 1, src.h - 1);
+
+				const V3 sum = src.GetColorI(u0, v0) + src.GetColorI(u1, v0) + src.GetColorI(u0, v1) + src.GetColorI(u1, v1);
+				dst->SetPixel(u, v, ColorFromV3(sum / 4.0f));
+			}
+		}
+
+		levels.push_back(std::move(dst));
+	}
+}
+
+float Texture::Lod(float dxdu, float dydu, float dxdv, float dydv) const {
+	const float w = (float) Base().w, h = (float) Base().h;
+
+	// texels covered per pixel, along whichever screen direction covers more
+	const float du2 = (dxdu * w) * (dxdu * w) + (dydu * h) * (dydu * h);
+	const float dv2 = (dxdv * w) * (dxdv * w) + (dydv * h) * (dydv * h);
+
+	// log2(sqrt(x)) = log2(x) / 2
+	return 0.5f * std::log2(std::max(du2, dv2));
+}
+
+V3 Texture::Sample(float x, float y, float lod, bool mirror, Filter filter) const {
+	const float maxLevel = (float) (levels.size() - 1);
+	// magnified textures (lod < 0) just use the full image. also catches NaN
+	if (!(lod > 0.0f)) lod = 0.0f;
+	if (lod > maxLevel) lod = maxLevel;
+
+	if (filter == FILTER_TRILINEAR) {
+		const size_t level = (size_t) lod;
+		const float t = lod - level;
+
+		const V3 c0 = SampleLevel(level, x, y, mirror, true);
+		if (t == 0.0f) return c0;
+
+		const V3 c1 = SampleLevel(level + 1, x, y, mirror, true);
+		return c0 * (1.0f - t) + c1 * t;
+	}
+
+	return SampleLevel((size_t) (lod + 0.5f), x, y, mirror, filter == FILTER_BILINEAR);
+}
+
+V3 Texture::SampleLevel(size_t level, float x, float y, bool mirror, bool bilinear) const {
+	const FrameBuffer &fb = *levels[level];
+
+	// texel centers are at half integers
+	float s = x * fb.w;
+	float t = y * fb.h;
+
+	if (!bilinear) {
+		return fb.GetColorI(Wrap((int) floorf(s), fb.w, mirror), Wrap((int) floorf(t), fb.h, mirror));
+	}
+
+	s -= 0.5f;
+	t -= 0.5f;
+
+	const float s0 = floorf(s), t0 = floorf(t);
+	const float fs = s - s0, ft = t - t0;
+
+	const int u0 = Wrap((int) s0, fb.w, mirror), u1 = Wrap((int) s0 + 1, fb.w, mirror);
+	const int v0 = Wrap((int) t0, fb.h, mirror), v1 = Wrap((int) t0 + 1, fb.h, mirror);
+
+	const V3 top = fb.GetColorI(u0, v0) * (1.0f - fs) + fb.GetColorI(u1, v0) * fs;
+	const V3 bottom = fb.GetColorI(u0, v1) * (1.0f - fs) + fb.GetColorI(u1, v1) * fs;
+	return top * (1.0f - ft) + bottom * ft;
+}
@@ -0,0 +1,46 @@
+#ifndef TEXTURE_HPP
+#define TEXTURE_HPP
+
+#include "frame_buffer.hpp"
+#include "math/v3.hpp"
+
+#include <memory>
+#include <vector>
+
+// an image with a precomputed mip chain. far away or sharply angled surfaces
+// sample a smaller level, which both stops aliasing and stays in cache
+struct Texture {
+	enum Filter: int {
+		FILTER_NEAREST = 0,
+		FILTER_BILINEAR = 1,
+		// bilinear on the two closest levels, blended together
+		FILTER_TRILINEAR = 2,
+	};
+
+	// level 0 is the full image, each next one is half the size of the last, down to 1x1
+	std::vector<std::unique_ptr<FrameBuffer>> levels;
+
+	Texture();
+
+	// load level 0 and build the rest
+	bool LoadFromTiff(const char *path);
+
+	// rebuild every level from level 0, call after changing it
+	void BuildMips(void);
+
+	inline FrameBuffer &Base(void) { return *levels[0]; }
+	inline const FrameBuffer &Base(void) const { return *levels[0]; }
+
+	// level of detail for a pixel, from how fast the texture coordinates
+	// (0 to 1 across the image) change per pixel in screen x and y
+	float Lod(float dxdu, float dydu, float dxdv, float dydv) const;
+
+	// sample at texture coordinates x, y. nearest and bilinear use the closest level to lod.
+	// mirror reflects the image every other repeat instead of tiling it
+	V3 Sample(float x, float y, float lod, bool mirror, Filter filter) const;
+
+private:
+	V3 SampleLevel(size_t level, float x, float y, bool mirror, bool bilinear) const;
+};
+
+#endif // TEXTURE_HPP
@@ -0,0 +1,109 @@
+#include "thread_pool.hpp"
+
+#include <cstdlib>
+
+// set while a thread is running ParallelFor work, so nested loops don't wait on themselves
+static thread_local bool insideJob = false;
+
+ThreadPool::ThreadPool(unsigned threadCount):
+	workerCount(0), job(nullptr), jobCount(0), nextIndex(0), busyWorkers(0), generation(0), stopping(false)
+{
+	Start(threadCount);
+}
+
+ThreadPool::~ThreadPool() {
+	Stop();
+}
+
+void ThreadPool::SetThreadCount(unsigned threadCount) {
+	std::lock_guard<std::mutex> submitLock(submitMutex);
+	Stop();
+	Start(threadCount);
+}
+
+unsigned ThreadPool::GetThreadCount(void) const {
+	return workerCount + 1;
+}
+
+void ThreadPool::Start(unsigned threadCount) {
+	if (threadCount == 0) threadCount = std::thread::hardware_concurrency();
+	if (threadCount == 0) threadCount = 1;
+
+	stopping = false;
+	for (unsigned i = 1; i < threadCount; i++) {
+		workers.emplace_back(&ThreadPool::WorkerLoop, this, generation);
+	}
+	workerCount = (unsigned) workers.size();
+}
+
+void ThreadPool::Stop(void) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+
+	for (auto &worker : workers) worker.join();
+	workers.clear();
+	workerCount = 0;
+}
+
+void ThreadPool::ParallelFor(size_t count, const std::function<void(size_t)> &fn) {
+	// nothing to split, or we are already one of the threads doing the splitting.
+	// the workers can change before submitMutex is taken, which only means running
+	// with fewer of them, or on this thread alone
+	if (count <= 1 || workerCount == 0 || insideJob) {
+		for (size_t i = 0; i < count; i++) fn(i);
+		return;
+	}
+
+	std::lock_guard<std::mutex> submitLock(submitMutex);
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		job = &fn;
+		jobCount = count;
+		nextIndex = 0;
+		busyWorkers = workers.size();
+		generation++;
+	}
+	wake.notify_all();
+
+	// help out instead of sleeping
+	RunJob();
+
+	std::unique_lock<std::mutex> lock(mutex);
+	done.wait(lock, [this] { return busyWorkers == 0; });
+	job = nullptr;
+}
+
+void ThreadPool::RunJob(void) {
+	insideJob = true;
+	for (size_t i = nextIndex++; i < jobCount; i = nextIndex++) {
+		(*job)(i);
+	}
+	insideJob = false;
+}
+
+void ThreadPool::WorkerLoop(uint64_t seenGeneration) {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		wake.wait(lock, [&] { return stopping || generation != seenGeneration; });
+		if (stopping) return;
+		seenGeneration = generation;
+
+		lock.unlock();
+		RunJob();
+		lock.lock();
+
+		if (--busyWorkers == 0) done.notify_one();
+	}
+}
+
+ThreadPool &ThreadPool::Global(void) {
+	static ThreadPool pool([] {
+		const char *env = std::getenv("RENDER_THREADS");
+		return env ? (unsigned) std::atoi(env) : 0u;
+	}());
+	return pool;
+}
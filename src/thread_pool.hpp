@@ -0,0 +1,59 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// a fixed set of worker threads that split loops between them.
+// the thread calling ParallelFor also does work, so a pool of
+// n threads only creates n - 1 workers
+struct ThreadPool {
+
+	// threadCount = 0 means one thread per hardware core
+	ThreadPool(unsigned threadCount = 0);
+	~ThreadPool();
+
+	// change the number of threads, including the calling thread
+	void SetThreadCount(unsigned threadCount);
+	unsigned GetThreadCount(void) const;
+
+	// calls fn(i) for every i in [0, count), spread across the threads,
+	// and returns once every call has finished.
+	// calls made from inside a ParallelFor job run serially on that thread
+	void ParallelFor(size_t count, const std::function<void(size_t)> &fn);
+
+	// the pool used by the renderer. its size comes from the
+	// RENDER_THREADS environment variable, or the core count if unset
+	static ThreadPool &Global(void);
+
+private:
+	void Start(unsigned threadCount);
+	void Stop(void);
+	// seenGeneration is the last job the worker should not run
+	void WorkerLoop(uint64_t seenGeneration);
+	void RunJob(void);
+
+	// only one ParallelFor at a time, and the workers only change while holding it
+	std::mutex submitMutex;
+	std::vector<std::thread> workers;
+	// workers.size(), for reading without submitMutex
+	std::atomic<unsigned> workerCount;
+
+	// protects everything below
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	const std::function<void(size_t)> *job;
+	size_t jobCount;
+	std::atomic<size_t> nextIndex;
+	size_t busyWorkers;
+	uint64_t generation;
+	bool stopping;
+};
+
+#endif // THREAD_POOL_HPP
@@ -0,0 +1,42 @@
+#include "tile_binner.hpp"
+#include "thread_pool.hpp"
+
+void TileBinner::Begin(const FrameBuffer &target) {
+	fb = &target;
+	tilesX = (fb->w + TILE_SIZE - 1) / TILE_SIZE;
+	tilesY = (fb->h + TILE_SIZE - 1) / TILE_SIZE;
+
+	// keep the old allocations around, they will probably be about the same size
+	bins.resize(tilesX * tilesY);
+	for (auto &bin : bins) bin.clear();
+	usedTiles.clear();
+}
+
+void TileBinner::Bin(uint32_t triangle, const V3 &p0, const V3 &p1, const V3 &p2) {
+	const ScreenRect bounds = fb->TriangleBounds(p0, p1, p2);
+	if (bounds.Empty()) return;
+
+	for (int ty = bounds.top / TILE_SIZE; ty <= bounds.bottom / TILE_SIZE; ty++) {
+		for (int tx = bounds.left / TILE_SIZE; tx <= bounds.right / TILE_SIZE; tx++) {
+			const uint32_t tile = tx + ty * tilesX;
+			if (bins[tile].empty()) usedTiles.push_back(tile);
+			bins[tile].push_back(triangle);
+		}
+	}
+}
+
+void TileBinner::Flush(const DrawFn &draw) {
+	ThreadPool::Global().ParallelFor(usedTiles.size(), [&](size_t i) {
+		const uint32_t tile = usedTiles[i];
+		const int tx = tile % tilesX, ty = tile / tilesX;
+
+		const ScreenRect rect = ScreenRect{
+			tx * TILE_SIZE, ty * TILE_SIZE,
+			(tx + 1) * TILE_SIZE - 1, (ty + 1) * TILE_SIZE - 1
+		}.Intersect(fb->Bounds());
+
+		for (uint32_t triangle : bins[tile]) {
+			draw(triangle, rect);
+		}
+	});
+}
@@ -0,0 +1,42 @@
+#ifndef TILE_BINNER_HPP
+#define TILE_BINNER_HPP
+
+#include "frame_buffer.hpp"
+#include "math/v3.hpp"
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// sorts projected triangles into square screen tiles so that each tile can be
+// rasterized by its own thread. a tile only ever writes its own pixels, so no
+// locking is needed, and each tile keeps its triangles in submission order,
+// so the result is the same as drawing every triangle one after another
+struct TileBinner {
+	static constexpr int TILE_SIZE = 64;
+	// the rasterizer updates whole hierarchical z blocks, so they can't be shared between tiles
+	static_assert(TILE_SIZE % FrameBuffer::HIZ_TILE == 0, "tiles must hold whole hierarchical z blocks");
+
+	// draws one binned triangle, only touching pixels inside the tile
+	using DrawFn = std::function<void(uint32_t triangle, const ScreenRect &tile)>;
+
+	// start binning for a frame buffer, forgetting any previous triangles
+	void Begin(const FrameBuffer &fb);
+
+	// add triangle (an index the caller understands) to every tile it might cover
+	void Bin(uint32_t triangle, const V3 &p0, const V3 &p1, const V3 &p2);
+
+	// draw every binned tile on the global thread pool
+	void Flush(const DrawFn &draw);
+
+private:
+	const FrameBuffer *fb = nullptr;
+	int tilesX = 0, tilesY = 0;
+
+	// triangle indices for each tile, row major
+	std::vector<std::vector<uint32_t>> bins;
+	// tiles with at least one triangle, so empty ones cost nothing to flush
+	std::vector<uint32_t> usedTiles;
+};
+
+#endif // TILE_BINNER_HPP
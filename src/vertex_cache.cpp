@@ -0,0 +1,150 @@
+#include "vertex_cache.hpp"
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+float AverageCacheMissRatio(const unsigned int *triangles, size_t triangleCount, size_t vertexCount, size_t cacheSize) {
+	if (triangleCount == 0) return 0.0f;
+
+	// a vertex is in the cache if fewer than cacheSize others have been loaded since it was.
+	// stamps are 1 + the miss count when it was loaded, 0 for never
+	std::vector<size_t> loadedAt(vertexCount, 0);
+	size_t misses = 0;
+
+	for (size_t i = 0; i < triangleCount * 3; i++) {
+		const unsigned int v = triangles[i];
+		if (loadedAt[v] == 0 || misses - (loadedAt[v] - 1) >= cacheSize) {
+			loadedAt[v] = ++misses;
+		}
+	}
+
+	return (float) misses / (float) triangleCount;
+}
+
+// scores from the original article. recently used vertices score higher, except the
+// three just used, which the next triangle would mostly share anyway. vertices with
+// few triangles left score higher, so they get finished off instead of left behind
+static constexpr float CACHE_DECAY_POWER = 1.5f;
+static constexpr float LAST_TRIANGLE_SCORE = 0.75f;
+static constexpr float VALENCE_BOOST_SCALE = 2.0f;
+static constexpr float VALENCE_BOOST_POWER = 0.5f;
+
+// the cache also holds the vertices of the triangle just added while they're being pushed out
+static constexpr size_t SCORING_CACHE_SIZE = VERTEX_CACHE_SIZE + 3;
+
+static float VertexScore(int cachePosition, uint32_t remaining) {
+	// nothing left to draw with it
+	if (remaining == 0) return -1.0f;
+
+	float score = 0.0f;
+	if (cachePosition >= 0) {
+		if (cachePosition < 3) {
+			score = LAST_TRIANGLE_SCORE;
+		} else {
+			const float scale = 1.0f / (VERTEX_CACHE_SIZE - 3);
+			score = powf(1.0f - (cachePosition - 3) * scale, CACHE_DECAY_POWER);
+		}
+	}
+
+	return score + VALENCE_BOOST_SCALE * powf((float) remaining, -VALENCE_BOOST_POWER);
+}
+
+void OptimizeTriangleOrder(unsigned int *triangles, size_t triangleCount, size_t vertexCount) {
+	if (triangleCount == 0) return;
+
+	const size_t indexCount = triangleCount * 3;
+
+	// the triangles using each vertex. the first remaining[v] are the ones not added yet
+	std::vector<uint32_t> firstTriangle(vertexCount + 1, 0);
+	for (size_t i = 0; i < indexCount; i++) firstTriangle[triangles[i] + 1]++;
+	for (size_t v = 0; v < vertexCount; v++) firstTriangle[v + 1] += firstTriangle[v];
+
+	std::vector<uint32_t> vertexTriangles(indexCount);
+	std::vector<uint32_t> remaining(vertexCount, 0);
+	for (size_t i = 0; i < indexCount; i++) {
+		const unsigned int v = triangles[i];
+		vertexTriangles[firstTriangle[v] + remaining[v]++] = (uint32_t) (i / 3);
+	}
+
+	std::vector<int> cachePosition(vertexCount, -1);
+	std::vector<float> vertexScore(vertexCount);
+	for (size_t v = 0; v < vertexCount; v++) vertexScore[v] = VertexScore(-1, remaining[v]);
+
+	std::vector<bool> added(triangleCount, false);
+
+	// most recently used first
+	uint32_t cache[SCORING_CACHE_SIZE], newCache[SCORING_CACHE_SIZE + 3];
+	size_t cacheCount = 0;
+
+	std::vector<unsigned int> order(indexCount);
+	// triangles before this have all been added. when nothing in the cache has any
+	// triangles left, the next one in the original order starts a new strip of work
+	size_t scanFrom = 0;
+	int64_t best = -1;
+
+	for (size_t out = 0; out < triangleCount; out++) {
+		if (best < 0) {
+			while (added[scanFrom]) scanFrom++;
+			best = (int64_t) scanFrom;
+		}
+
+		const unsigned int *tri = triangles + 3 * best;
+		added[best] = true;
+		for (int k = 0; k < 3; k++) order[3 * out + k] = tri[k];
+
+		// forget this triangle in its vertices' lists
+		for (int k = 0; k < 3; k++) {
+			const unsigned int v = tri[k];
+			uint32_t *list = vertexTriangles.data() + firstTriangle[v];
+			for (uint32_t j = 0; j < remaining[v]; j++) {
+				if (list[j] == (uint32_t) best) {
+					list[j] = list[remaining[v] - 1];
+					remaining[v]--;
+					break;
+				}
+			}
+		}
+
+		// its vertices move to the front of the cache
+		size_t newCount = 0;
+		for (int k = 0; k < 3; k++) newCache[newCount++] = tri[k];
+		for (size_t j = 0; j < cacheCount; j++) {
+			const uint32_t v = cache[j];
+			if (v != tri[0] && v != tri[1] && v != tri[2]) newCache[newCount++] = v;
+		}
+
+		// vertices pushed out of the cache lose their cache score
+		for (size_t j = SCORING_CACHE_SIZE; j < newCount; j++) {
+			cachePosition[newCache[j]] = -1;
+			vertexScore[newCache[j]] = VertexScore(-1, remaining[newCache[j]]);
+		}
+
+		cacheCount = newCount < SCORING_CACHE_SIZE ? newCount : SCORING_CACHE_SIZE;
+		for (size_t j = 0; j < cacheCount; j++) {
+			const uint32_t v = newCache[j];
+			cache[j] = v;
+			cachePosition[v] = j < VERTEX_CACHE_SIZE ? (int) j : -1;
+			vertexScore[v] = VertexScore(cachePosition[v], remaining[v]);
+		}
+
+		// only triangles touching the cache changed score, so the next one is picked from them
+		best = -1;
+		float bestScore = -1.0f;
+		for (size_t j = 0; j < cacheCount; j++) {
+			const uint32_t v = cache[j];
+			const uint32_t *list = vertexTriangles.data() + firstTriangle[v];
+			for (uint32_t l = 0; l < remaining[v]; l++) {
+				const uint32_t t = list[l];
+				const unsigned int *other = triangles + 3 * t;
+				const float score = vertexScore[other[0]] + vertexScore[other[1]] + vertexScore[other[2]];
+				if (score > bestScore) {
+					bestScore = score;
+					best = t;
+				}
+			}
+		}
+	}
+
+	for (size_t i = 0; i < indexCount; i++) triangles[i] = order[i];
+}
@@ -163,7 +163,7 @@ void Window::FrameEnd() {
 		SDL_GL_SwapWindow(window);
 	} else {
 		// put pixels on the texture
-		SDL_UpdateTexture(texture, NULL, fb.cb, w * sizeof(*fb.cb));
+		SDL_UpdateTexture(texture, NULL, fb.LinearColors(), w * sizeof(*fb.cb));
 
 		// put the texture on the screen
 		SDL_RenderClear(renderer);